@@ -0,0 +1,197 @@
+/// converts pixlar_store files to one columnar file, decoding in parallel
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pixlar.h"
+
+// Output file layout, little-endian:
+//   char magic[8] "PIXCOL1"
+//   uint32 ncols, uint32 reserved
+//   ncols x col_t descriptors
+//   column data, each column starts at its offset (8-byte aligned)
+// Hit columns have one row per input word in input order; chunk_* columns have one row per chunk.
+// Run markers keep their row with type PKT_MARK, chip MARK_BEG/MARK_END and timestamp holding the run number.
+#define COL_MAGIC "PIXCOL1"
+#define CHUNK_WORDS (1<<20) // words per work unit
+
+typedef struct {
+  char name[24];
+  uint32_t size;   // element size, bytes
+  uint32_t reserved;
+  uint64_t count;  // number of elements
+  uint64_t offset; // from file start
+} col_t;
+
+enum {C_SRC, C_TYPE, C_CHIP, C_CHAN, C_TS, C_ADC, C_PARITY, C_FIFO, CH_WORDS, CH_DATA, CH_BADPAR, CH_USEC, NCOLS};
+const char *colname[NCOLS]={"src","type","chip","channel","timestamp","adc","parity","fifo",
+                            "chunk_words","chunk_data","chunk_badparity","chunk_usec"};
+const uint32_t colsize[NCOLS]={1,1,1,1,4,2,1,1,8,8,8,8};
+
+typedef struct {
+  const uint64_t *words; // mapped input
+  uint64_t n;            // words in chunk
+  uint64_t row;          // first output row
+} chunk_t;
+
+chunk_t *chunks;
+int nchunks;
+volatile int nextchunk=0;
+uint8_t *out;       // mapped output file
+col_t cols[NCOLS];
+
+void usage()
+{
+ printf("Converts raw pixlar_store files (name.1 name.2 ...) to a columnar file with decoded fields.\n Usage: ");
+ printf("pixlar_convert [-j <threads>] [-v] <output> <file> [<file> ...]\n");
+ printf("-j: number of worker threads, all cores by default. -v: print statistics of every chunk.\n");
+ printf("Columns: src chip channel timestamp adc parity type fifo, one row per word; chunk_* statistics, one row per chunk.\n");
+}
+
+uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000ULL+ts.tv_nsec/1000;
+}
+
+void *worker(void *arg)
+{
+    int c;
+    uint64_t i, row, w, t0, ndata, nbad;
+    uint8_t *src=out+cols[C_SRC].offset, *type=out+cols[C_TYPE].offset, *chip=out+cols[C_CHIP].offset;
+    uint8_t *chan=out+cols[C_CHAN].offset, *parity=out+cols[C_PARITY].offset, *fifo=out+cols[C_FIFO].offset;
+    uint32_t *ts=(uint32_t*)(out+cols[C_TS].offset);
+    uint16_t *adc=(uint16_t*)(out+cols[C_ADC].offset);
+    while((c=__sync_fetch_and_add(&nextchunk,1))<nchunks)
+    {
+      chunk_t *ch=&chunks[c];
+      t0=now_us(); ndata=0; nbad=0;
+      for(i=0; i<ch->n; i++)
+      {
+        w=ch->words[i];
+        row=ch->row+i;
+        if(WORD_ISMARK(w))
+        {
+          src[row]=0; type[row]=PKT_MARK; chip[row]=MARK_TYPE(w); chan[row]=0;
+          ts[row]=MARK_RUN(w); adc[row]=0; parity[row]=1; fifo[row]=0;
+          continue;
+        }
+        src[row]=(w&WORD_CHANB) ? 1 : 0;
+        type[row]=PKT_TYPE(w);
+        chip[row]=PKT_CHIP(w);
+        chan[row]=PKT_CHAN(w);
+        ts[row]=PKT_TS(w);
+        adc[row]=PKT_ADC(w);
+        parity[row]=PKT_PARITY(w);
+        fifo[row]=PKT_FIFO(w);
+        ndata+=(PKT_TYPE(w)==PKT_DATA);
+        nbad+=!parity[row];
+      }
+      ((uint64_t*)(out+cols[CH_WORDS].offset))[c]=ch->n;
+      ((uint64_t*)(out+cols[CH_DATA].offset))[c]=ndata;
+      ((uint64_t*)(out+cols[CH_BADPAR].offset))[c]=nbad;
+      ((uint64_t*)(out+cols[CH_USEC].offset))[c]=now_us()-t0;
+    }
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+int nthreads=sysconf(_SC_NPROCESSORS_ONLN), verbose=0, i, k, nfiles;
+uint64_t nwords=0, n, off, total;
+i=1;
+while(i<argc && argv[i][0]=='-')
+ {
+  if(strcmp(argv[i],"-j")==0 && i+1<argc) nthreads=atoi(argv[++i]);
+  else if(strcmp(argv[i],"-v")==0) verbose=1;
+  else { usage(); return 0;}
+  i++;
+ }
+if(argc-i<2 || nthreads<1) { usage(); return 0;}
+const char *outname=argv[i++];
+nfiles=argc-i;
+
+// map inputs and split them into chunks
+const uint64_t **in=calloc(nfiles,sizeof(uint64_t*));
+uint64_t *inlen=calloc(nfiles,sizeof(uint64_t));
+nchunks=0;
+for(k=0; k<nfiles; k++)
+ {
+  struct stat st;
+  int fd=open(argv[i+k],O_RDONLY);
+  if(fd<0 || fstat(fd,&st)<0) { printf("Can't open %s!\n",argv[i+k]); return -1;}
+  inlen[k]=st.st_size/sizeof(uint64_t);
+  if(inlen[k]>0)
+   {
+    in[k]=mmap(NULL,inlen[k]*sizeof(uint64_t),PROT_READ,MAP_PRIVATE,fd,0);
+    if(in[k]==MAP_FAILED) { perror("Can't map input file"); return -1;}
+    madvise((void*)in[k],inlen[k]*sizeof(uint64_t),MADV_SEQUENTIAL);
+   }
+  close(fd);
+  nwords+=inlen[k];
+  nchunks+=(inlen[k]+CHUNK_WORDS-1)/CHUNK_WORDS;
+ }
+chunks=calloc(nchunks>0 ? nchunks : 1,sizeof(chunk_t));
+nchunks=0; n=0;
+for(k=0; k<nfiles; k++)
+  for(off=0; off<inlen[k]; off+=CHUNK_WORDS)
+   {
+    chunks[nchunks].words=in[k]+off;
+    chunks[nchunks].n= inlen[k]-off<CHUNK_WORDS ? inlen[k]-off : CHUNK_WORDS;
+    chunks[nchunks].row=n;
+    n+=chunks[nchunks].n;
+    nchunks++;
+   }
+
+// lay out columns and map output, workers write straight into it
+off=16+NCOLS*sizeof(col_t);
+for(k=0; k<NCOLS; k++)
+ {
+  memset(&cols[k],0,sizeof(col_t));
+  strncpy(cols[k].name,colname[k],sizeof(cols[k].name)-1);
+  cols[k].size=colsize[k];
+  cols[k].count= k<CH_WORDS ? nwords : (uint64_t)nchunks;
+  cols[k].offset=off;
+  off+=(cols[k].count*cols[k].size+7)&~7ULL;
+ }
+total=off;
+int fd=open(outname,O_RDWR|O_CREAT|O_TRUNC,0644);
+if(fd<0 || ftruncate(fd,total)<0) { printf("Can't create %s!\n",outname); return -1;}
+out=mmap(NULL,total,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+if(out==MAP_FAILED) { perror("Can't map output file"); return -1;}
+memcpy(out,COL_MAGIC,8);
+uint32_t hdr[2]={NCOLS,0};
+memcpy(out+8,hdr,8);
+memcpy(out+16,cols,sizeof(cols));
+
+uint64_t t0=now_us();
+if(nthreads>nchunks) nthreads= nchunks>0 ? nchunks : 1;
+pthread_t *th=calloc(nthreads,sizeof(pthread_t));
+for(k=0; k<nthreads; k++)
+  if(pthread_create(&th[k],NULL,worker,NULL)!=0) { perror("Can't start thread"); return -1;}
+for(k=0; k<nthreads; k++) pthread_join(th[k],NULL);
+double dt=(now_us()-t0)/1e6;
+
+uint64_t ndata=0, nbad=0;
+if(verbose) printf("chunk     words      data  badparity   time,us\n");
+for(k=0; k<nchunks; k++)
+ {
+  uint64_t *cw=(uint64_t*)(out+cols[CH_WORDS].offset), *cd=(uint64_t*)(out+cols[CH_DATA].offset);
+  uint64_t *cb=(uint64_t*)(out+cols[CH_BADPAR].offset), *cu=(uint64_t*)(out+cols[CH_USEC].offset);
+  ndata+=cd[k]; nbad+=cb[k];
+  if(verbose) printf("%5d %9llu %9llu %10llu %9llu\n",k,(long long unsigned)cw[k],(long long unsigned)cd[k],(long long unsigned)cb[k],(long long unsigned)cu[k]);
+ }
+munmap(out,total);
+close(fd);
+printf("%llu words (%llu data packets, %llu bad parity) from %d files in %d chunks, %d threads: %.3f s, %.1f Mwords/s\n",
+       (long long unsigned)nwords,(long long unsigned)ndata,(long long unsigned)nbad,nfiles,nchunks,nthreads,dt,dt>0 ? nwords/dt/1e6 : 0);
+for(k=0; k<nfiles; k++) if(inlen[k]>0) munmap((void*)in[k],inlen[k]*sizeof(uint64_t));
+return 0;
+}
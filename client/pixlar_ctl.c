@@ -42,6 +42,13 @@ zmq_msg_t reply;
 zmq_msg_init (&reply);
 zmq_msg_recv (&reply, requester, 0);
 printf ("Received reply: %s\n", (char*)zmq_msg_data (&reply));
+if(zmq_msg_size(&reply)>5) //binary data follows 5-byte status
+ {
+  size_t i;
+  printf ("Data:");
+  for(i=5; i<zmq_msg_size(&reply); i++) printf(" %02x", ((uint8_t*)zmq_msg_data (&reply))[i]);
+  printf ("\n");
+ }
 zmq_msg_close (&reply);
 zmq_close (requester);
 zmq_ctx_destroy (context);
@@ -0,0 +1,69 @@
+/// decodes stored data files or flight recorder dumps, prints hits with unwrapped timestamps
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pixlar.h"
+
+#define NBUF 4096
+
+ts_unwrap_t unwrapper;
+geo_map_t geometry;
+
+void usage()
+{
+ printf("Decodes LArPix words from pixlar_store files (name.1 name.2 ...) or flight recorder dumps and prints one hit per line.\n Usage: ");
+ printf("pixlar_decode [-r] [-d <divider>] [-g <geometry>] <file> [<file> ...]\n");
+ printf("-r: files are flight recorder dumps with host monotonic time of each word, otherwise raw words. \n");
+ printf("-d: CLOCKx2 divider used in the run, 5 (10 MHz) by default. \n");
+ printf("-g: geometry file, lines <uart> <chip> <channel> <x> <y>; adds pixel position to the output. \n");
+ printf("Files of one run must be given in order, timestamps are unwrapped across them. Run markers are printed as # DAQ_BEG/DAQ_END <run> lines.\n");
+}
+
+int main (int argc, char **argv)
+{
+int recmode=0, div=5, geo=0, i, k, n;
+uint64_t words[NBUF], host[NBUF];
+rec_word_t rec[NBUF];
+larpix_hit_t hits[NBUF];
+float x[NBUF], y[NBUF];
+i=1;
+while(i<argc && argv[i][0]=='-')
+ {
+  if(strcmp(argv[i],"-r")==0) recmode=1;
+  else if(strcmp(argv[i],"-d")==0 && i+1<argc) div=atoi(argv[++i]);
+  else if(strcmp(argv[i],"-g")==0 && i+1<argc) { if(geo_load(&geometry,argv[++i])<0) return 0; geo=1; }
+  else { usage(); return 0;}
+  i++;
+ }
+if(i>=argc) { usage(); return 0;}
+ts_init(&unwrapper, div);
+printf("#src chip chan type  adc       ts           ts64            time,ns parity%s\n", geo ? "        x        y" : "");
+for(; i<argc; i++)
+ {
+  FILE *fp=fopen(argv[i],"r");
+  if(fp==NULL) { printf("Can't open %s!\n",argv[i]); continue;}
+  while(1)
+   {
+    if(recmode)
+     {
+      n=fread(rec,sizeof(rec_word_t),NBUF,fp);
+      for(k=0; k<n; k++) { words[k]=rec[k].word; host[k]=rec[k].time; }
+     }
+    else n=fread(words,sizeof(uint64_t),NBUF,fp);
+    if(n<=0) break;
+    larpix_decode(&unwrapper, words, recmode ? host : NULL, n, hits);
+    if(geo) geo_xy(&geometry, hits, n, x, y);
+    for(k=0; k<n; k++)
+     {
+      if(hits[k].type==PKT_MARK) { printf("# %s %u\n", hits[k].chip==MARK_BEG ? "DAQ_BEG" : "DAQ_END", hits[k].ts); continue; }
+      printf("%4d %4d %4d %4d %4d %8u %14llu %19llu %d", hits[k].src, hits[k].chip, hits[k].channel, hits[k].type, hits[k].adc,
+             hits[k].ts, (long long unsigned)hits[k].ts64, (long long unsigned)hits[k].time, hits[k].parity);
+      if(geo) printf("      %8.2f %8.2f", x[k], y[k]);
+      printf("\n");
+     }
+   }
+  fclose(fp);
+ }
+return 0;
+}
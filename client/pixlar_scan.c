@@ -0,0 +1,71 @@
+/// runs threshold/pedestal scan on the board via pixlar_cmdserver and prints per-channel results
+#include <zmq.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pixlar.h"
+
+void usage()
+{
+ printf("Usage: ");
+ printf("pixlar_scan <socket> <uart> <first chip> <last chip> <register> <per channel> <start> <stop> <step> <dwell ms> [<settle ms>]\n");
+ printf("Socket string, example: tcp://localhost:5555 \n");
+ printf("<per channel> 1 writes <register>+channel for every channel (pixel trims), 0 writes <register> once per chip.\n");
+ printf("Output: value chip channel hits adc_mean adc_rms, one line per channel with hits.\n");
+}
+
+int main (int argc, char **argv)
+{
+int rv=0;
+if(argc<11 || argc>12) { usage(); return 0;}
+scan_cfg_t cfg;
+memset(&cfg,0,sizeof(cfg));
+cfg.src=atoi(argv[2]);
+cfg.chip_first=atoi(argv[3]); cfg.chip_last=atoi(argv[4]);
+cfg.reg=strtol(argv[5],NULL,0); cfg.perchan=atoi(argv[6]);
+cfg.start=strtol(argv[7],NULL,0); cfg.stop=strtol(argv[8],NULL,0); cfg.step=strtol(argv[9],NULL,0);
+cfg.dwell_us=atof(argv[10])*1000;
+cfg.settle_us= argc>11 ? atof(argv[11])*1000 : SCAN_SETTLE;
+void * context = zmq_ctx_new ();
+//  Socket to talk to server
+printf ("Connecting to driver...\n");
+void *requester = zmq_socket (context, ZMQ_REQ);
+rv=zmq_connect (requester, argv[1]); if(rv<0) {printf("Connection to %s failed!\n",argv[1]); return 0;}
+zmq_msg_t request;
+zmq_msg_init_size (&request, 8+sizeof(cfg));
+memcpy(zmq_msg_data (&request), "SCANREG ", 8);
+memcpy((uint8_t*)zmq_msg_data (&request)+8, &cfg, sizeof(cfg));
+printf ("Sending scan...\n");
+zmq_msg_send (&request, requester, 0);
+zmq_msg_close (&request);
+zmq_msg_t reply;
+zmq_msg_init (&reply);
+zmq_msg_recv (&reply, requester, 0);
+printf ("Received reply: %s\n", (char*)zmq_msg_data (&reply));
+if(zmq_msg_size(&reply)>=13)
+ {
+  int32_t nsteps, nchips;
+  int s, c, ch;
+  uint8_t *d=(uint8_t*)zmq_msg_data (&reply)+5;
+  memcpy(&nsteps,d,4); memcpy(&nchips,d+4,4);
+  if(zmq_msg_size(&reply)>=13+(size_t)nsteps*nchips*LARPIX_NCHAN*sizeof(scan_cell_t))
+   {
+    scan_cell_t r;
+    uint8_t *p=d+8; // reply data is not aligned
+    printf("#value chip chan     hits  adc_mean  adc_rms\n");
+    for(s=0; s<nsteps; s++)
+      for(c=0; c<nchips; c++)
+        for(ch=0; ch<LARPIX_NCHAN; ch++, p+=sizeof(r))
+         {
+          memcpy(&r,p,sizeof(r));
+          if(r.count) printf("%6d %4d %4d %8u %9.2f %8.2f\n", cfg.start+s*cfg.step, cfg.chip_first+c, ch, r.count, r.mean, r.rms);
+         }
+   }
+ }
+zmq_msg_close (&reply);
+zmq_close (requester);
+zmq_ctx_destroy (context);
+return 0;
+}
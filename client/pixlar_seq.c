@@ -0,0 +1,99 @@
+/// assembles text command sequence, runs it on the board via pixlar_cmdserver and prints per-step results
+#include <zmq.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include "pixlar.h"
+
+uint8_t prog[65536-16]; // server accepts commands up to 64 kB
+int plen=0;
+int pline[SEQ_MAXSTEPS]; // source line of each step
+
+void usage()
+{
+ printf("Usage: ");
+ printf("pixlar_seq <socket> <channel> <program file>\n");
+ printf("Socket string, example: tcp://localhost:5555 \n");
+ printf("Program file, one step per line, # starts a comment:\n");
+ printf("  SEND <word>\n  WAIT <us>\n  EXPECT <mask> <value> <timeout us>\n  LOOP <n>\n  END\n  RESET\n  SETDIV <divider>\n");
+}
+
+void put(void *p, int n) { memcpy(prog+plen,p,n); plen+=n; }
+
+int assemble(FILE *f) // returns number of steps, -1 on error
+{
+char line[256], op[32], sa[32], sb[32], sc[32];
+uint64_t a,b,c;
+int n, nstep=0, iline=0;
+while(fgets(line,sizeof(line),f))
+ {
+  iline++;
+  char *h=strchr(line,'#'); if(h) *h=0;
+  sa[0]=sb[0]=sc[0]=0;
+  n=sscanf(line,"%31s %31s %31s %31s",op,sa,sb,sc);
+  if(n<1) continue;
+  a=strtoull(sa,NULL,0); b=strtoull(sb,NULL,0); c=strtoull(sc,NULL,0);
+  if(nstep>=SEQ_MAXSTEPS || plen>(int)sizeof(prog)-32) {printf("Program too long at line %d\n",iline); return -1;}
+  uint32_t u=a;
+  if(strcmp(op,"SEND")==0 && n==2) {prog[plen++]=SEQ_SEND; put(&a,8);}
+  else if(strcmp(op,"WAIT")==0 && n==2) {prog[plen++]=SEQ_WAIT; put(&u,4);}
+  else if(strcmp(op,"EXPECT")==0 && n==4) {prog[plen++]=SEQ_EXPECT; put(&a,8); put(&b,8); u=c; put(&u,4);}
+  else if(strcmp(op,"LOOP")==0 && n==2) {prog[plen++]=SEQ_LOOP; put(&u,4);}
+  else if(strcmp(op,"END")==0 && n==1) prog[plen++]=SEQ_ENDLOOP;
+  else if(strcmp(op,"RESET")==0 && n==1) prog[plen++]=SEQ_RESET;
+  else if(strcmp(op,"SETDIV")==0 && n==2) {prog[plen++]=SEQ_SETDIV; put(&u,4);}
+  else {printf("Syntax error at line %d: %s\n",iline,line); return -1;}
+  pline[nstep++]=iline;
+ }
+return nstep;
+}
+
+int main (int argc, char **argv)
+{
+int rv=0;
+if(argc!=4) { usage(); return 0;}
+FILE *f=fopen(argv[3],"r");
+if(f==NULL) {printf("Can't open %s!\n",argv[3]); return 0;}
+int nstep=assemble(f);
+fclose(f);
+if(nstep<0) return 0;
+void * context = zmq_ctx_new ();
+//  Socket to talk to server
+printf ("Connecting to driver...\n");
+void *requester = zmq_socket (context, ZMQ_REQ);
+rv=zmq_connect (requester, argv[1]); if(rv<0) {printf("Connection to %s failed!\n",argv[1]); return 0;}
+zmq_msg_t request;
+zmq_msg_init_size (&request, 9+plen);
+memcpy(zmq_msg_data (&request), "RUN_SEQ ", 8);
+((uint8_t*)zmq_msg_data (&request))[8]=atoi(argv[2]);
+memcpy((uint8_t*)zmq_msg_data (&request)+9, prog, plen);
+printf ("Sending %d steps (%d bytes) to channel %s...\n", nstep, plen, argv[2]);
+zmq_msg_send (&request, requester, 0);
+zmq_msg_close (&request);
+zmq_msg_t reply;
+zmq_msg_init (&reply);
+zmq_msg_recv (&reply, requester, 0);
+printf ("Received reply: %s\n", (char*)zmq_msg_data (&reply));
+if(zmq_msg_size(&reply)>=13)
+ {
+  int32_t res, n;
+  int i;
+  uint8_t *d=(uint8_t*)zmq_msg_data (&reply)+5;
+  memcpy(&res,d,4); memcpy(&n,d+4,4);
+  if(res>0) printf("Failed at step %d (line %d)\n",res-1,pline[res-1]);
+  else if(res<0) printf("Program rejected by server\n");
+  printf("step line  count  time,us  last read-back\n");
+  for(i=0; i<n && 13+(i+1)*(int)sizeof(seq_stat_t)<=(int)zmq_msg_size(&reply); i++)
+   {
+    seq_stat_t st;
+    memcpy(&st,d+8+i*sizeof(seq_stat_t),sizeof(st));
+    printf("%4d %4d %6u %8u  0x%016llx\n",i,pline[i],st.count,st.us,(long long unsigned)st.word);
+   }
+ }
+zmq_msg_close (&reply);
+zmq_close (requester);
+zmq_ctx_destroy (context);
+return 0;
+}
@@ -6,8 +6,22 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include "pixlar.h"
 
 FILE *fp;
+char *fbase;
+int findex, oindex; // file index, index of last file outside of run
+int run=-1; // run number from last DAQ_BEG marker, -1 outside of run
+
+void nextfile() // closes current file and opens next one, <filename>_run<N>.<index> inside of run
+{
+ char filename[160];
+ if(fp) fclose(fp);
+ if(run>=0) sprintf(filename,"%s_run%d.%d",fbase,run,findex);
+ else sprintf(filename,"%s.%d",fbase,findex);
+ fp=fopen(filename,"a");
+ if(fp==NULL) { printf("Can't open %s!\n",filename); exit(1);}
+}
 
 void usage()
 {
@@ -16,6 +30,7 @@ void usage()
  printf("pixlar_store <socket> <filename>  <max events>\n");
  printf("If <filename> is omitted, outputs data to stdout.\n");
  printf("<max events> is maximum number of polls per file. If reached, the index in file name increments. Optional, set to 10000 by default. \n");
+ printf("Run markers from DAQ_BEG/DAQ_END start new files <filename>_run<N>.1, ... at the marker word; the marker is stored as the first (DAQ_BEG) or last (DAQ_END) word of the run.\n");
  printf("Interface example:  tcp://localhost:5556 \n");
 
 }
@@ -24,19 +39,19 @@ int main (int argc, char **argv)
 {
 int rv;
 char * iface;
-char filename[128];
 char sim[4]={'|','/','-','\\'};
 int isim=0;
 time_t t0,t1;
 int dt,dt0;
-int polls, maxpolls, findex;
+int polls, maxpolls;
+size_t k, nw;
+uint64_t w;
 if(argc<2 || argc>4) { usage(); return 0;}
 iface=argv[1];
 //filename=argv[2];
 findex=1; polls=0;
-if(argc>2) sprintf(filename,"%s.%d",argv[2],findex);
 if(argc==4) maxpolls=atoi(argv[3]); else maxpolls=10000;
-if(argc>2) fp=fopen(filename,"a"); 
+if(argc>2) { fbase=argv[2]; nextfile(); }
 void * context = zmq_ctx_new ();
 //  Socket to talk to server
 printf ("Connecting to pixlar_dataserver at %s...\n",iface);
@@ -62,12 +77,36 @@ while(zmq_msg_recv (&reply, subscriber, ZMQ_DONTWAIT)==-1)
                       dt0=dt;
   }
  };
-if(argc==2) printf ("%0llx\n", *(long long unsigned int*)(zmq_msg_data (&reply)));
+nw=zmq_msg_size(&reply)/sizeof(uint64_t);
+if(argc==2)
+  for(k=0; k<nw; k++)
+   {
+    memcpy(&w,(char*)zmq_msg_data(&reply)+k*8,8);
+    if(WORD_ISMARK(w)) printf("# %s %u\n", MARK_TYPE(w)==MARK_BEG ? "DAQ_BEG" : "DAQ_END", MARK_RUN(w));
+    else printf ("%0llx\n", (long long unsigned)w);
+   }
 if(argc>2) 
   {
    printf("\b%c",sim[isim]); fflush(stdout); if(isim<3) isim++; else isim=0;
-   fwrite((char*)(zmq_msg_data(&reply)),zmq_msg_size(&reply) , 1, fp);
-   fflush(fp);
+   for(k=0; k<nw; k++) // split message at run markers
+    {
+     memcpy(&w,(char*)zmq_msg_data(&reply)+k*8,8);
+     if(WORD_ISMARK(w) && MARK_TYPE(w)==MARK_BEG)
+      {
+       if(run<0) oindex=findex;
+       run=MARK_RUN(w); findex=1; polls=0; nextfile();
+       printf("\nRun %d begins\n",run);
+      }
+     if(fp==NULL) nextfile(); // opened only when data follows, no empty file between back-to-back runs
+     fwrite(&w,8,1,fp);
+     if(WORD_ISMARK(w) && MARK_TYPE(w)==MARK_END && (int)MARK_RUN(w)==run)
+      {
+       printf("\nRun %d ends\n",run);
+       run=-1; findex=oindex+1; polls=0;
+       fclose(fp); fp=NULL;
+      }
+    }
+   if(fp) fflush(fp);
   } 
 zmq_msg_close (&reply);
 polls++;
@@ -75,16 +114,13 @@ polls++;
 if(polls>maxpolls) 
   {
     polls=0;
-    findex++;
-    fclose(fp);
-    sprintf(filename,"%s.%d",argv[2],findex);
-    fp=fopen(filename,"a"); 
+    if(argc>2 && fp) { findex++; nextfile(); } // no file open after run end, next data opens it
   }
   
 }
 zmq_close (subscriber);
 zmq_ctx_destroy (context);
-if(argc>2) fclose(fp);
+if(argc>2 && fp) fclose(fp);
 return 0;
 }
 
@@ -0,0 +1,22 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "pixlar.h"
+
+// Scans CLOCKx2 dividers with loopback test on both channels, from slow to fast until the first failure,
+// and sets the divider CALIB_MARGIN steps slower than the fastest one that passed.
+// pixlar_dataserver must not be running, otherwise it steals loopback words.
+int main(int argc, char *argv[]) {
+
+    int divmin=CALIB_DIVMIN, divmax=CALIB_DIVMAX, nwords=CALIB_NWORDS;
+    if(argc>4) { printf("Usage: clk_calib [<words per step> [<min divider> [<max divider>]]]\n"); return 0;}
+    if(argc>1) nwords= strtol(argv[1],NULL,0); 
+    if(argc>2) divmin= strtol(argv[2],NULL,0); 
+    if(argc>3) divmax= strtol(argv[3],NULL,0); 
+
+    if(clk_calibrate(divmin, divmax, nwords)<0) return -1;
+    return 0;
+}
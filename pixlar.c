@@ -4,8 +4,18 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
 #include "pixlar.h"
 
+static uint64_t mono_us() // monotonic time, us
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000ULL+ts.tv_nsec/1000;
+}
+
 int rgb(int r1, int g1, int b1, int r2, int g2, int b2)
 {
 
@@ -19,6 +29,7 @@ int rgb(int r1, int g1, int b1, int r2, int g2, int b2)
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
     volatile uint8_t *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
     if (mem == MAP_FAILED) {
         perror("Can't map memory");
         return -1;
@@ -58,21 +69,30 @@ int uart54_send(int chan, uint64_t *buf, int num)// send 54-bits word to channel
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
     volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
     if (mem == MAP_FAILED) {
         perror("Can't map memory");
         return -1;
     }
 
     size_t i;
+    uint64_t t;
     for( i=0; i<num; i++)
     {
-      while( *(mem+page_offset+7)<0x80) {}
+      t=mono_us();
+      while( *(mem+page_offset+7)<0x80 && mono_us()-t<UART_TIMEOUT) {}
+      if( *(mem+page_offset+7)<0x80) break; // TX stalled
       *((volatile uint64_t*)(mem+page_offset))=buf[i];
     }
   munmap((void*)mem, page_offset + len);
-  return 0;
+  return i==num ? 0 : -1;
 } 
-int uart54_recv(int chan, uint64_t *buf, int num) // blocks until receive requested num words
+int uart54_recv(int chan, uint64_t *buf, int num) // receives up to num words, gives up UART_TIMEOUT after last word; returns number of words received, -1 on error
+{
+    return uart54_recv_timeout(chan, buf, num, UART_TIMEOUT);
+}
+
+int uart54_recv_timeout(int chan, uint64_t *buf, int num, int timeout_us) // as uart54_recv with timeout_us, UART_FOREVER blocks until num words are received
 {
     off_t offset;
     if(chan==0) offset = UART54_A_RECV;
@@ -87,23 +107,26 @@ int uart54_recv(int chan, uint64_t *buf, int num) // blocks until receive reques
     off_t page_offset = offset - page_base;
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
-//    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
     volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
     if (mem == MAP_FAILED) {
         perror("Can't map memory");
         return -1;
     }
 
-    size_t i;
+    int i;
+    uint64_t t;
     for( i=0; i<num; i++)
      { 
-      while(mem[page_offset+len-1]<0x80) {} //wait until word is available in UART: data_ready
+      t=mono_us();
+      while(mem[page_offset+len-1]<0x80 && (timeout_us<0 || mono_us()-t<(uint64_t)timeout_us)) {} //wait until word is available in UART: data_ready
+      if(mem[page_offset+len-1]<0x80) break;
       buf[i]=*(volatile uint64_t*)(mem+page_offset); 
       mem[page_offset+len-1]=0; //reset data_ready bit
      }
   munmap((void*)mem, page_offset + len);
 
-  return num;
+  return i;
 } 
 int uart54_available(int chan) //returns 1 if word is available in buffer, 0 otherwise
 {
@@ -123,13 +146,44 @@ int uart54_available(int chan) //returns 1 if word is available in buffer, 0 oth
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
 //    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
     volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
     if (mem == MAP_FAILED) {
         perror("Can't map memory");
         return -1;
     }
 
     if(mem[page_offset+len-1]<0x80) retval=0;
-    else retval=0;
+    else retval=1;
+    munmap((void*)mem, page_offset + len);
+
+    return retval;
+} 
+
+int uart54_txready(int chan) //returns 1 if TX is ready for next word, 0 if busy
+{
+    int retval;
+    off_t offset;
+    if(chan==0) offset = UART54_A_SEND;
+    else if(chan==1) offset = UART54_B_SEND;
+    else return -1;
+
+    size_t len = 8;
+
+    // Truncate offset to a multiple of the page size, or mmap will fail.
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    off_t page_base = (offset / pagesize) * pagesize;
+    off_t page_offset = offset - page_base;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return -1;
+    }
+
+    if(mem[page_offset+len-1]<0x80) retval=0;
+    else retval=1;
     munmap((void*)mem, page_offset + len);
 
     return retval;
@@ -138,15 +192,23 @@ int uart54_available(int chan) //returns 1 if word is available in buffer, 0 oth
 int setCLKx2(int FkHz) // set PIXLAR CLOCKx2 output frequency, kHz
 {
   
-    off_t offset=CLOCKx2_DIVIDER;
-    size_t len = 8;
     uint32_t div=5;
     float fresult;
-    uint32_t FBASE=50000; // base frequency, kHz (50 MHz)
+    uint32_t FBASE=CLK_FBASE; // base frequency, kHz (50 MHz)
+    if(FkHz<1) return -1;
     div=FBASE/FkHz;
     if(div<1) return -1;
     fresult=FBASE/div;
     printf("Frequency divider set to %d, CLOCKx2=%f kHz\n",div,fresult);
+    return setCLKdiv(div);
+
+}
+
+int setCLKdiv(int div) // set CLOCKx2 divider directly, CLOCKx2=CLK_FBASE/div kHz
+{
+    off_t offset=CLOCKx2_DIVIDER;
+    size_t len = 8;
+    if(div<1) return -1;
     // Truncate offset to a multiple of the page size, or mmap will fail.
     size_t pagesize = sysconf(_SC_PAGE_SIZE);
     off_t page_base = (offset / pagesize) * pagesize;
@@ -154,6 +216,7 @@ int setCLKx2(int FkHz) // set PIXLAR CLOCKx2 output frequency, kHz
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
     volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
     if (mem == MAP_FAILED) {
         perror("Can't map memory");
         return -1;
@@ -162,7 +225,6 @@ int setCLKx2(int FkHz) // set PIXLAR CLOCKx2 output frequency, kHz
       *((volatile uint32_t*)(mem+page_offset))=div-1;
   munmap((void*)mem, page_offset + len);
   return 0;
-
 }
 
 int system_reset() //issues system reset pulse for UART and PIXLAR asics
@@ -175,6 +237,7 @@ int system_reset() //issues system reset pulse for UART and PIXLAR asics
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
     volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
     if (mem == MAP_FAILED) {
         perror("Can't map memory");
         return -1;
@@ -189,3 +252,564 @@ int system_reset() //issues system reset pulse for UART and PIXLAR asics
 return 0;
 }
 
+int getCLKdiv() // returns current CLOCKx2 divider, -1 on error
+{
+    off_t offset=CLOCKx2_DIVIDER;
+    size_t len = 8;
+    // Truncate offset to a multiple of the page size, or mmap will fail.
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    off_t page_base = (offset / pagesize) * pagesize;
+    off_t page_offset = offset - page_base;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return -1;
+    }
+
+    int div=*((volatile uint32_t*)(mem+page_offset))+1;
+  munmap((void*)mem, page_offset + len);
+  return div;
+}
+
+int uart54_bertest(int chan, int nwords, uint64_t *nbits) // loopback test, returns number of bad words (nbits - number of wrong bits), -1 on error
+{
+    off_t offset;
+    uint64_t magic;
+    if(chan==0) {offset = UART54_A_RECV; magic=MAGIC_A;}
+    else if(chan==1) {offset = UART54_B_RECV; magic=MAGIC_B;}
+    else return -1;
+    size_t len = 16; // RECV and SEND registers are in the same page
+
+    // Truncate offset to a multiple of the page size, or mmap will fail.
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    off_t page_base = (offset / pagesize) * pagesize;
+    off_t page_offset = offset - page_base;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return -1;
+    }
+    volatile unsigned char *rx=mem+page_offset;
+    volatile unsigned char *tx=mem+page_offset+8;
+
+    int i, bad=0;
+    uint64_t w, r, t, bits=0;
+    rx[7]=0; //drop stale word, if any
+    for(i=0; i<nwords; i++)
+    {
+      // alternate magic word with its complement and scramble with index to toggle payload bits, type and chip ID stay as in magic word
+      w=((magic ^ ((i&1) ? UART54_MASK : 0) ^ ((uint64_t)i*0x9e3779b97f4a7c15ULL)) & UART54_MASK & ~MAGIC_HDR) | (magic & MAGIC_HDR);
+      t=mono_us();
+      while(tx[7]<0x80 && mono_us()-t<CALIB_TIMEOUT) {}
+      if(tx[7]<0x80) {bad++; bits+=54; continue;}
+      *((volatile uint64_t*)tx)=w;
+      t=mono_us();
+      while(rx[7]<0x80 && mono_us()-t<CALIB_TIMEOUT) {}
+      if(rx[7]<0x80) {bad++; bits+=54; continue;} //word lost
+      r=*(volatile uint64_t*)rx;
+      rx[7]=0; //reset data_ready bit
+      r=(r^w)&UART54_MASK;
+      if(r) {bad++; bits+=__builtin_popcountll(r);}
+    }
+  munmap((void*)mem, page_offset + len);
+  if(nbits) *nbits=bits;
+  return bad;
+}
+
+int clk_calibrate(int divmin, int divmax, int nwords) // scans dividers slow to fast, sets and returns one CALIB_MARGIN steps slower than first failure, -1 if none (previous divider is restored)
+{
+    int div, chan, bad, best=-1, fail=-1, olddiv;
+    uint64_t nbits;
+    double ber;
+    if(divmin<1 || divmax<divmin || nwords<1) return -1;
+    if((olddiv=getCLKdiv())<1) return -1;
+    printf("CLOCKx2 calibration: dividers %d..%d, %d words per channel\n",divmin,divmax,nwords);
+    printf("  div  CLOCKx2,kHz   badA   BER_A        badB   BER_B\n");
+    for(div=divmax; div>=divmin; div--) // slow to fast
+    {
+      if(setCLKdiv(div)<0) { setCLKdiv(olddiv); return -1; }
+      usleep(1000); // let UARTs settle at the new rate
+      printf("%5d %12.1f",div,(float)CLK_FBASE/div);
+      bad=0;
+      for(chan=0; chan<2; chan++)
+      {
+        int b=uart54_bertest(chan,nwords,&nbits);
+        if(b<0) { printf("\n"); setCLKdiv(olddiv); return -1; }
+        ber=(double)nbits/((double)nwords*54);
+        printf(" %6d   %.3e",b,ber);
+        bad+=b;
+      }
+      printf("\n");
+      if(bad) { fail=div; break; } // faster dividers are not trusted, even if they pass
+    }
+    if(fail<0) best=divmin; // whole range is error-free
+    else if(fail+1+CALIB_MARGIN<=divmax) best=fail+1+CALIB_MARGIN;
+    if(best<0)
+    {
+      setCLKdiv(olddiv);
+      printf("CLOCKx2 calibration: no error-free divider with margin found, divider %d restored!\n",olddiv);
+      return -1;
+    }
+    setCLKdiv(best);
+    printf("CLOCKx2 calibration: divider set to %d, CLOCKx2=%f kHz\n",best,(float)CLK_FBASE/best);
+    return best;
+}
+
+int seq_oplen(uint8_t op) // operand length of sequence opcode, -1 if unknown
+{
+    switch(op)
+    {
+      case SEQ_SEND: return 8;
+      case SEQ_WAIT: return 4;
+      case SEQ_EXPECT: return 20;
+      case SEQ_LOOP: return 4;
+      case SEQ_ENDLOOP: return 0;
+      case SEQ_RESET: return 0;
+      case SEQ_SETDIV: return 4;
+    }
+    return -1;
+}
+
+static void seq_wait(uint32_t us) // sleeps for long waits, spins for the last ms to keep timing
+{
+    uint64_t t=mono_us();
+    if(us>2000) usleep(us-1000);
+    while(mono_us()-t<us) {}
+}
+
+int seq_run(int chan, const uint8_t *prog, int len, seq_stat_t *stat, int *nsteps) // runs program on channel chan, fills per-step stat[SEQ_MAXSTEPS]; returns 0 if OK, failed step index+1, -1 if program is malformed
+{
+    int pos[SEQ_MAXSTEPS];   // step offsets in program
+    int match[SEQ_MAXSTEPS]; // matching SEQ_LOOP/SEQ_ENDLOOP step
+    int stack[SEQ_MAXDEPTH]; // open loops while parsing
+    uint32_t left[SEQ_MAXDEPTH]; // remaining iterations while running
+    int n=0, depth=0, p=0, l, i, rv=0;
+
+    *nsteps=0;
+    // parse and validate whole program before touching hardware
+    while(p<len)
+    {
+      l=seq_oplen(prog[p]);
+      if(l<0 || p+1+l>len || n>=SEQ_MAXSTEPS) return -1;
+      if(prog[p]==SEQ_LOOP) { if(depth>=SEQ_MAXDEPTH) return -1; stack[depth++]=n; }
+      if(prog[p]==SEQ_ENDLOOP) { if(depth==0) return -1; depth--; match[n]=stack[depth]; match[stack[depth]]=n; }
+      pos[n++]=p;
+      p+=1+l;
+    }
+    if(depth) return -1;
+    *nsteps=n;
+    memset(stat, 0, n*sizeof(seq_stat_t));
+
+    off_t offset;
+    if(chan==0) offset = UART54_A_RECV;
+    else if(chan==1) offset = UART54_B_RECV;
+    else return -1;
+    size_t mlen = 16; // RECV and SEND registers are in the same page
+
+    // Truncate offset to a multiple of the page size, or mmap will fail.
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    off_t page_base = (offset / pagesize) * pagesize;
+    off_t page_offset = offset - page_base;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    volatile unsigned char *mem = mmap(NULL, page_offset + mlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return -1;
+    }
+    volatile unsigned char *rx=mem+page_offset;
+    volatile unsigned char *tx=mem+page_offset+8;
+
+    uint64_t w, mask, val, t0, t;
+    uint32_t u32;
+    depth=0;
+    for(i=0; i<n && rv==0; i++)
+    {
+      const uint8_t *arg=prog+pos[i]+1;
+      int cur=i; // loops may move i
+      t0=mono_us();
+      switch(prog[pos[i]])
+      {
+        case SEQ_SEND:
+          memcpy(&w, arg, 8);
+          while(tx[7]<0x80 && mono_us()-t0<UART_TIMEOUT) {}
+          if(tx[7]<0x80) {rv=i+1; break;}
+          *((volatile uint64_t*)tx)=w;
+          break;
+        case SEQ_WAIT:
+          memcpy(&u32, arg, 4);
+          seq_wait(u32);
+          break;
+        case SEQ_EXPECT:
+          memcpy(&mask, arg, 8); memcpy(&val, arg+8, 8); memcpy(&u32, arg+16, 4);
+          while(1)
+          {
+            t=mono_us();
+            if(rx[7]>=0x80)
+            {
+              w=*(volatile uint64_t*)rx;
+              rx[7]=0; //reset data_ready bit
+              stat[i].word=w;
+              if((w&mask)==val) break;
+            }
+            if(t-t0>=u32) {rv=i+1; break;}
+          }
+          break;
+        case SEQ_LOOP:
+          memcpy(&u32, arg, 4);
+          if(u32==0) {i=match[i]; break;} // skip loop body
+          left[depth++]=u32;
+          break;
+        case SEQ_ENDLOOP:
+          if(--left[depth-1]>0) i=match[i]; // back to SEQ_LOOP, body starts at next step
+          else depth--;
+          break;
+        case SEQ_RESET:
+          system_reset();
+          break;
+        case SEQ_SETDIV:
+          memcpy(&u32, arg, 4);
+          if(setCLKdiv(u32)<0) rv=i+1;
+          break;
+      }
+      if(rv==0) stat[cur].count++; // failed step is not counted, its word was not sent or read back
+      stat[cur].us+=mono_us()-t0;
+    }
+    munmap((void*)mem, page_offset + mlen);
+    return rv;
+}
+
+void ts_init(ts_unwrap_t *u, int div) // resets unwrapper for CLOCKx2 divider div
+{
+    memset(u, 0, sizeof(ts_unwrap_t));
+    if(div<1) div=1;
+    u->tick=1e6*div*TS_CLKDIV/CLK_FBASE;
+}
+
+uint64_t larpix_packet(int type, int chip, int chan, uint32_t ts, int adc) // builds data packet with valid parity
+{
+    uint64_t w=(uint64_t)(type&0x3) | (uint64_t)(chip&0xff)<<2 | (uint64_t)(chan&0x7f)<<10 |
+               (uint64_t)(ts&0xffffff)<<17 | (uint64_t)(adc&0x3ff)<<41;
+    if(!__builtin_parityll(w)) w|=1ULL<<53; // odd parity
+    return w;
+}
+
+uint64_t larpix_config(int chip, int reg, int val) // builds configuration write packet with valid parity
+{
+    uint64_t w=(uint64_t)PKT_CFGW | (uint64_t)(chip&0xff)<<2 | (uint64_t)(reg&0xff)<<10 | (uint64_t)(val&0xff)<<18;
+    if(!__builtin_parityll(w)) w|=1ULL<<53; // odd parity
+    return w;
+}
+
+void larpix_decode_word(uint64_t w, larpix_hit_t *hit) // splits word into fields, no timestamp unwrapping
+{
+    if(WORD_ISMARK(w))
+    {
+      memset(hit,0,sizeof(larpix_hit_t));
+      hit->type=PKT_MARK;
+      hit->chip=MARK_TYPE(w);
+      hit->parity=1;
+      hit->ts=MARK_RUN(w);
+      hit->ts64=hit->ts;
+      return;
+    }
+    hit->src=(w&WORD_CHANB) ? 1 : 0;
+    hit->type=PKT_TYPE(w);
+    hit->chip=PKT_CHIP(w);
+    hit->channel=PKT_CHAN(w);
+    hit->adc=PKT_ADC(w);
+    hit->fifo=PKT_FIFO(w);
+    hit->parity=PKT_PARITY(w);
+    hit->ts=PKT_TS(w);
+    hit->ts64=hit->ts;
+    hit->time=0;
+}
+
+void ts_unwrap(ts_unwrap_t *u, larpix_hit_t *hit, uint64_t host) // extends hit timestamp to 64 bits and sets its host time; host=0 if unknown
+{
+    const uint64_t wrap=1ULL<<TS_BITS;
+    ts_chip_t *c=&u->chip[hit->src][hit->chip];
+    uint64_t ts, pred;
+    double x, y, dx, lambda;
+
+    hit->time=host;
+    if(hit->type!=PKT_DATA) return; // only data packets carry timestamp
+    if(u->n==0)
+    {
+      ts=hit->ts;
+      u->x0=ts; u->y0=host;
+    }
+    else
+    {
+      // predict counter from host time elapsed since last hit of this chip, so gaps longer than a wrap are handled;
+      // first hit of a chip is predicted from the last hit of any chip, all counters run on the same CLOCKx2;
+      // without host time successive hits must be less than half a wrap apart
+      uint64_t last= c->n ? c->last : u->last, lasthost= c->n ? c->lasthost : u->lasthost;
+      pred=last;
+      if(host>lasthost && lasthost) pred+=(uint64_t)((host-lasthost)/u->tick);
+      ts=(pred&~(wrap-1))|hit->ts; // candidate nearest to prediction
+      if(ts+wrap/2<pred) ts+=wrap;
+      else if(ts>pred+wrap/2 && ts>=wrap) ts-=wrap;
+    }
+    c->last=ts;
+    if(host) c->lasthost=host;
+    if(ts>u->last || u->n==0) { u->last=ts; if(host) u->lasthost=host; }
+    u->n++;
+    hit->ts64=ts;
+
+    // host time = my + slope*(x-mx), fitted per chip with exponential forgetting, relative to the shared origin
+    x=(double)(int64_t)(ts-u->x0);
+    if(host)
+    {
+      y=(double)(int64_t)(host-u->y0);
+      lambda=1.0-1.0/TS_FIT_N;
+      c->sw=lambda*c->sw+1;
+      dx=x-c->mx;
+      c->mx+=dx/c->sw;
+      c->my+=(y-c->my)/c->sw;
+      c->cxx=lambda*c->cxx+dx*(x-c->mx);
+      c->cxy=lambda*c->cxy+dx*(y-c->my);
+    }
+    c->n++;
+    double slope=u->tick, span=1e9*TS_FIT_SPAN/u->tick;
+    if(c->sw>0 && c->cxx>span*span*c->sw) slope=c->cxy/c->cxx;
+    if(slope<u->tick*(1-TS_FIT_MAXDEV) || slope>u->tick*(1+TS_FIT_MAXDEV)) slope=u->tick;
+    hit->time=u->y0+(int64_t)(c->my+slope*(x-c->mx));
+}
+
+int larpix_decode(ts_unwrap_t *u, const uint64_t *words, const uint64_t *host, int n, larpix_hit_t *hits) // decodes n words, host[] may be NULL; returns n
+{
+    int i;
+    for(i=0; i<n; i++)
+    {
+      larpix_decode_word(words[i], &hits[i]);
+      ts_unwrap(u, &hits[i], host ? host[i] : 0);
+    }
+    return n;
+}
+
+int geo_load(geo_map_t *g, const char *fname) // loads geometry file, lines "<uart> <chip> <channel> <x> <y>", uart -1 for both; returns number of lines loaded, -1 on error
+{
+    char line[256];
+    int src, chip, chan, i, n=0, iline=0;
+    float x, y;
+    FILE *f=fopen(fname,"r");
+    if(f==NULL) { perror("Can't open geometry file"); return -1; }
+    for(i=0; i<GEO_SIZE; i++) { g->pix[i].x=NAN; g->pix[i].y=NAN; }
+    while(fgets(line,sizeof(line),f))
+    {
+      iline++;
+      char *h=strchr(line,'#'); if(h) *h=0;
+      if(sscanf(line,"%d",&src)<1) continue; // empty line
+      if(sscanf(line,"%d %d %d %f %f",&src,&chip,&chan,&x,&y)!=5 || src<-1 || src>1 || chip<0 || chip>255 || chan<0 || chan>127)
+      {
+        printf("Geometry file %s, line %d: bad pixel description\n",fname,iline);
+        fclose(f);
+        return -1;
+      }
+      for(i=0; i<2; i++)
+        if(src<0 || src==i) { g->pix[GEO_INDEX(i,chip,chan)].x=x; g->pix[GEO_INDEX(i,chip,chan)].y=y; }
+      n++;
+    }
+    fclose(f);
+    return n;
+}
+
+int geo_xy(const geo_map_t *g, const larpix_hit_t *hits, int n, float *x, float *y) // fills hit positions, NAN if unknown; returns number of hits with known position
+{
+    int i, found=0;
+    for(i=0; i<n; i++)
+    {
+      const geo_xy_t *p=&g->pix[GEO_INDEX(hits[i].src,hits[i].chip,hits[i].channel)];
+      if(hits[i].type==PKT_MARK) { x[i]=y[i]=NAN; continue; }
+      x[i]=p->x;
+      y[i]=p->y;
+      found+=(p->x==p->x); // false for NAN
+    }
+    return found;
+}
+
+int larpix_scan(const scan_cfg_t *cfg, scan_cell_t *res) // runs scan, res[step][chip-chip_first][channel]; returns number of steps, -1 on error
+{
+    int nsteps, nchips, s, c, ch, val, ncells, k;
+    uint64_t w, t0;
+    if(cfg->chip_first>cfg->chip_last || cfg->step==0 || cfg->start>cfg->stop) return -1;
+    if(cfg->perchan && cfg->reg+LARPIX_NCHAN-1>255) return -1; // per-channel registers would wrap to register 0
+    nsteps=(cfg->stop-cfg->start)/cfg->step+1;
+    nchips=cfg->chip_last-cfg->chip_first+1;
+    ncells=nchips*LARPIX_NCHAN;
+    if(nsteps*ncells>SCAN_MAXCELLS) return -1;
+
+    off_t offset;
+    if(cfg->src==0) offset = UART54_A_RECV;
+    else if(cfg->src==1) offset = UART54_B_RECV;
+    else return -1;
+    size_t len = 16; // RECV and SEND registers are in the same page
+
+    // Truncate offset to a multiple of the page size, or mmap will fail.
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    off_t page_base = (offset / pagesize) * pagesize;
+    off_t page_offset = offset - page_base;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return -1;
+    }
+    volatile unsigned char *rx=mem+page_offset;
+    volatile unsigned char *tx=mem+page_offset+8;
+
+    double *sum=malloc(2*ncells*sizeof(double)), *sum2=sum+ncells;
+    if(sum==NULL) { munmap((void*)mem, page_offset + len); return -1; }
+
+    for(s=0; s<nsteps; s++)
+    {
+      val=cfg->start+s*cfg->step;
+      // configure all chips for this step
+      for(c=cfg->chip_first; c<=cfg->chip_last; c++)
+        for(ch=0; ch<(cfg->perchan ? LARPIX_NCHAN : 1); ch++)
+        {
+          t0=mono_us();
+          while(tx[7]<0x80 && mono_us()-t0<UART_TIMEOUT) {}
+          if(tx[7]<0x80) { free(sum); munmap((void*)mem, page_offset + len); return -1; }
+          *((volatile uint64_t*)tx)=larpix_config(c, cfg->reg+ch, val);
+        }
+      // drop words while chips settle
+      t0=mono_us();
+      while(mono_us()-t0<cfg->settle_us) if(rx[7]>=0x80) rx[7]=0;
+      // collect and reduce hits
+      memset(sum, 0, 2*ncells*sizeof(double));
+      scan_cell_t *r=res+s*ncells;
+      memset(r, 0, ncells*sizeof(scan_cell_t));
+      t0=mono_us();
+      while(mono_us()-t0<cfg->dwell_us)
+      {
+        if(rx[7]<0x80) continue;
+        w=*(volatile uint64_t*)rx;
+        rx[7]=0; //reset data_ready bit
+        if(PKT_TYPE(w)!=PKT_DATA || PKT_CHIP(w)<cfg->chip_first || PKT_CHIP(w)>cfg->chip_last || PKT_CHAN(w)>=LARPIX_NCHAN) continue;
+        k=(PKT_CHIP(w)-cfg->chip_first)*LARPIX_NCHAN+PKT_CHAN(w);
+        r[k].count++;
+        sum[k]+=PKT_ADC(w);
+        sum2[k]+=(double)PKT_ADC(w)*PKT_ADC(w);
+      }
+      for(k=0; k<ncells; k++)
+        if(r[k].count)
+        {
+          double m=sum[k]/r[k].count; // variance from unrounded mean
+          double var=sum2[k]/r[k].count-m*m;
+          r[k].mean=m;
+          r[k].rms= var>0 ? sqrt(var) : 0;
+        }
+    }
+    free(sum);
+    munmap((void*)mem, page_offset + len);
+    return nsteps;
+}
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *p=data;
+    size_t i;
+    for(i=0; i<len; i++) { h^=p[i]; h*=16777619u; }
+    return h;
+}
+
+uint32_t state_checksum(const larpix_state_t *st) // checksum of chip configuration (written registers only)
+{
+    uint32_t h=2166136261u;
+    int src, chip, reg;
+    uint8_t e[4];
+    for(src=0; src<2; src++)
+      for(chip=0; chip<256; chip++)
+        for(reg=0; reg<256; reg++)
+          if(st->set[src][chip][reg])
+          {
+            e[0]=src; e[1]=chip; e[2]=reg; e[3]=st->val[src][chip][reg];
+            h=fnv1a(h, e, 4);
+          }
+    return h;
+}
+
+// State file: uint32 magic, int32 clkdiv, char bitstream[64], uint32 n, n x {src, chip, reg, val}, uint32 checksum of all preceding bytes
+int state_save(const larpix_state_t *st, const char *fname) // saves state atomically, returns 0 on success, -1 on error
+{
+    char tmp[256];
+    uint32_t magic=STATE_MAGIC, n=0, h=2166136261u;
+    int src, chip, reg;
+    uint8_t e[4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+    FILE *f=fopen(tmp, "w");
+    if(f==NULL) return -1;
+    for(src=0; src<2; src++)
+      for(chip=0; chip<256; chip++)
+        for(reg=0; reg<256; reg++)
+          n+=st->set[src][chip][reg];
+    fwrite(&magic, 4, 1, f); h=fnv1a(h, &magic, 4);
+    fwrite(&st->clkdiv, 4, 1, f); h=fnv1a(h, &st->clkdiv, 4);
+    fwrite(st->bitstream, sizeof(st->bitstream), 1, f); h=fnv1a(h, st->bitstream, sizeof(st->bitstream));
+    fwrite(&n, 4, 1, f); h=fnv1a(h, &n, 4);
+    for(src=0; src<2; src++)
+      for(chip=0; chip<256; chip++)
+        for(reg=0; reg<256; reg++)
+          if(st->set[src][chip][reg])
+          {
+            e[0]=src; e[1]=chip; e[2]=reg; e[3]=st->val[src][chip][reg];
+            fwrite(e, 4, 1, f); h=fnv1a(h, e, 4);
+          }
+    fwrite(&h, 4, 1, f);
+    if(fclose(f)!=0) { unlink(tmp); return -1; }
+    return rename(tmp, fname);
+}
+
+int state_load(larpix_state_t *st, const char *fname) // returns number of configured registers, -1 if file is missing or corrupt
+{
+    uint32_t magic, n, i, sum, h=2166136261u;
+    uint8_t e[4];
+    FILE *f=fopen(fname, "r");
+    if(f==NULL) return -1;
+    memset(st, 0, sizeof(larpix_state_t));
+    if(fread(&magic, 4, 1, f)!=1 || magic!=STATE_MAGIC) goto bad;
+    h=fnv1a(h, &magic, 4);
+    if(fread(&st->clkdiv, 4, 1, f)!=1) goto bad;
+    h=fnv1a(h, &st->clkdiv, 4);
+    if(fread(st->bitstream, sizeof(st->bitstream), 1, f)!=1) goto bad;
+    h=fnv1a(h, st->bitstream, sizeof(st->bitstream));
+    st->bitstream[sizeof(st->bitstream)-1]=0;
+    if(fread(&n, 4, 1, f)!=1 || n>2*256*256) goto bad;
+    h=fnv1a(h, &n, 4);
+    for(i=0; i<n; i++)
+    {
+      if(fread(e, 4, 1, f)!=1 || e[0]>1) goto bad;
+      h=fnv1a(h, e, 4);
+      st->val[e[0]][e[1]][e[2]]=e[3];
+      st->set[e[0]][e[1]][e[2]]=1;
+    }
+    if(fread(&sum, 4, 1, f)!=1 || sum!=h) goto bad;
+    fclose(f);
+    return n;
+bad:
+    fclose(f);
+    memset(st, 0, sizeof(larpix_state_t));
+    return -1;
+}
+
+int bitstream_fingerprint(char *buf, int len) // reads load token of bitstream (md5 and load time), -1 if unknown
+{
+    buf[0]=0;
+    FILE *f=fopen(BITSTREAM_LOAD, "r");
+    if(f==NULL) return -1;
+    if(fgets(buf, len, f)==NULL) { fclose(f); buf[0]=0; return -1; }
+    fclose(f);
+    buf[strcspn(buf, "\r\n")]=0;
+    return buf[0] ? 0 : -1;
+}
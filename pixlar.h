@@ -1,3 +1,7 @@
+#ifndef PIXLAR_H
+#define PIXLAR_H
+#include <stdint.h>
+
 //CLOCKx2 generator
 #define CLOCKx2_DIVIDER 0x43c00000
 
@@ -21,14 +25,186 @@
 #define LED2_G  0x43c30010
 #define LED2_R  0x43c30014
 
+#define UART_TIMEOUT 100000 // TX ready and default RX timeout, us; longer wait means the channel is stalled
+#define UART_FOREVER (-1)   // timeout value for callers that want to block until data arrives
+
+//Link calibration
+#define CLK_FBASE 50000 // CLOCKx2 base frequency, kHz (50 MHz)
+#define UART54_MASK 0x003fffffffffffffULL // 54 payload bits of UART word
+#define MAGIC_A 0x0ff5a5a5a5a5a5a5ULL // loopback test words, see test script
+#define MAGIC_B 0x0ff5b5b5b5b5b5b5ULL
+#define MAGIC_HDR 0x3ffULL // packet type and chip ID bits, kept from magic word in every test word: test packet (type 1) to chip 0x69 (A) or 0x6d (B), never a configuration write
+#define CALIB_DIVMIN 1   // fastest divider tried by calibration, 50 MHz
+#define CALIB_DIVMAX 50  // slowest divider tried by calibration, 1 MHz
+#define CALIB_NWORDS 1000 // default number of test words per channel per step
+#define CALIB_TIMEOUT 1000 // loopback word timeout, us
+#define CALIB_MARGIN 1    // chosen divider is this many steps slower than the fastest one that passed
+
+//Command sequence engine. Program is a list of steps: opcode byte followed by little-endian operands
+#define SEQ_SEND    0x01 // uint64 word: send word to the channel
+#define SEQ_WAIT    0x02 // uint32 us: wait
+#define SEQ_EXPECT  0x03 // uint64 mask, uint64 value, uint32 timeout us: wait for read-back word with (word&mask)==value
+#define SEQ_LOOP    0x04 // uint32 n: repeat steps up to matching SEQ_ENDLOOP n times
+#define SEQ_ENDLOOP 0x05 // end of loop body
+#define SEQ_RESET   0x06 // system_reset pulse
+#define SEQ_SETDIV  0x07 // uint32 div: set CLOCKx2 divider
+#define SEQ_MAXSTEPS 1024 // max number of steps in a program
+#define SEQ_MAXDEPTH 8    // max loop nesting
+
+typedef struct {
+  uint32_t count; // number of times step completed, failed attempt is not counted
+  uint32_t us;    // total time spent in step, us
+  uint64_t word;  // last word read back by SEQ_EXPECT
+} seq_stat_t;
+
 //ZMQ data backend
 #define EVLEN 8
+#define WORD_READY 0x8000000000000000ULL // data_ready bit, set in every received word
+#define WORD_CHANB 0x4000000000000000ULL // set by pixlar_dataserver in words received from channel B
+#define DATA_CTL "tcp://localhost:5557" // pixlar_dataserver control socket, as seen from the board
+#define DATA_ACK "tcp://localhost:5558" // pixlar_dataserver acknowledgements of control messages (PAUSED)
+#define PAUSE_MAX 60000 // pixlar_dataserver resumes by itself after this long, unless PAUSE gives another limit, ms
+#define CMD_SOCK "tcp://localhost:5555" // pixlar_cmdserver socket, as seen from the board
+#define RECOVER_FORCE 2 // RECOVER argument flag: reset even if TX of the channel is ready
+
+//Run markers, inserted into data stream by pixlar_dataserver on DAQ_BEG/DAQ_END at exact word position.
+//Marker has WORD_READY clear, so it can't be mistaken for a received word: bits 48-63 MARK_SIG, 32-39 MARK_*, 0-31 run number
+#define MARK_SIG 0x4d52ULL // "MR"
+#define MARK_BEG 1
+#define MARK_END 2
+#define MARK_WORD(type,run) ((MARK_SIG<<48)|((uint64_t)((type)&0xff)<<32)|(uint32_t)(run))
+#define WORD_ISMARK(w) (((w)>>48)==MARK_SIG)
+#define MARK_TYPE(w) (((w)>>32)&0xff)
+#define MARK_RUN(w)  ((uint32_t)(w))
+
+//Flight recorder dump file is a sequence of rec_word_t
+typedef struct {
+  uint64_t word; // received word, as published by pixlar_dataserver
+  uint64_t time; // host CLOCK_MONOTONIC when word was read, ns
+} rec_word_t;
+
+//LArPix data packet fields in 54-bit word
+#define PKT_TYPE(w)  ((w)&0x3)
+#define PKT_CHIP(w)  (((w)>>2)&0xff)
+#define PKT_CHAN(w)  (((w)>>10)&0x7f)
+#define PKT_TS(w)    (((w)>>17)&0xffffff)
+#define PKT_ADC(w)   (((w)>>41)&0x3ff)
+#define PKT_FIFO(w)  (((w)>>51)&0x3)
+#define PKT_PARITY(w) __builtin_parityll((w)&UART54_MASK) // 1 if odd parity is OK
+#define PKT_DATA 0
+#define PKT_TEST 1
+#define PKT_CFGW 2
+#define PKT_CFGR 3
+#define PKT_MARK 4 // not a packet: run marker, decoded with chip=MARK_* and ts=run number
+#define PKT_REG(w)     (((w)>>10)&0xff) // configuration packet register address
+#define PKT_REGDATA(w) (((w)>>18)&0xff) // configuration packet register data
+#define LARPIX_NCHAN 32  // channels per chip
+
+//Threshold/pedestal scan: steps register value on a range of chips and collects hits at every step
+#define SCAN_MAXCELLS (1<<20) // max steps*chips*LARPIX_NCHAN in one scan
+#define SCAN_SETTLE 10000     // default wait after configuration before collecting, us
+
+typedef struct {
+  uint8_t src;                   // UART channel, 0->A, 1->B
+  uint8_t chip_first, chip_last; // chip ID range
+  uint8_t reg;                   // register address to scan
+  uint8_t perchan;               // 1: register is per channel, reg+channel is written for every channel
+  uint8_t start, stop, step;     // register values
+  uint32_t dwell_us;             // time collecting hits at each step
+  uint32_t settle_us;            // wait after writing configuration, words received meanwhile are dropped
+} scan_cfg_t;
+
+typedef struct {
+  uint32_t count; // data packets
+  float mean;     // ADC mean
+  float rms;      // ADC rms
+} scan_cell_t;
+
+//Hardware state kept across daemon restarts, /run is cleared on reboot together with FPGA
+#define STATE_DIR "/run/pixlar"
+#define STATE_FILE STATE_DIR "/state"                 // saved by pixlar_cmdserver
+#define BITSTREAM_LOAD STATE_DIR "/bitstream.load"    // "<md5> <load time, ns>", written by firmware/update_bitstream on every load
+#define STATE_MAGIC 0x31415850u // "PXA1" in the file
+
+typedef struct {
+  int32_t clkdiv;            // CLOCKx2 divider
+  char bitstream[64];        // load token of bitstream, changes on every FPGA load
+  uint8_t val[2][256][256];  // chip configuration [uart][chip][register]
+  uint8_t set[2][256][256];  // 1 if register was written
+} larpix_state_t;
+
+//Timestamp unwrapping
+#define TS_BITS 24      // chip timestamp counter width
+#define TS_CLKDIV 2     // timestamp counts chip clock, CLOCKx2/2
+#define TS_FIT_N 1024   // host clock fit averages over about this many hits per chip
+#define TS_FIT_SPAN 1.0 // fitted slope is used once hits spread over this many seconds (rms), nominal before
+#define TS_FIT_MAXDEV 1e-3 // max relative deviation of fitted slope from nominal
+
+typedef struct {
+  uint8_t src;     // UART channel, 0->A, 1->B
+  uint8_t type;    // packet type, PKT_*
+  uint8_t chip;    // chip ID
+  uint8_t channel; // chip channel
+  uint16_t adc;
+  uint8_t fifo;    // FIFO half/full flags
+  uint8_t parity;  // 1 if parity is OK
+  uint32_t ts;     // raw chip timestamp
+  uint64_t ts64;   // unwrapped timestamp, chip clock ticks
+  uint64_t time;   // host time of hit, ns, same clock as passed to ts_unwrap
+} larpix_hit_t;
+
+typedef struct {
+  uint64_t last, lasthost; // last unwrapped timestamp and its host time
+  double sw, mx, my, cxx, cxy; // exponentially weighted fit of host time vs timestamp
+  uint32_t n;
+} ts_chip_t;
+
+typedef struct {
+  double tick; // nominal timestamp tick, ns
+  uint64_t x0, y0;         // time origin shared by all chips (same CLOCKx2): first timestamp and host time
+  uint64_t last, lasthost; // last unwrapped timestamp of any chip and its host time
+  uint32_t n;              // data packets seen
+  ts_chip_t chip[2][256]; // per UART channel and chip ID
+} ts_unwrap_t;
+
+//Pixel geometry, flat lookup table indexed by UART channel, chip ID and chip channel
+#define GEO_SIZE (2*256*128)
+#define GEO_INDEX(src,chip,chan) ((((src)&1)<<15)|(((chip)&0xff)<<7)|((chan)&0x7f))
+
+typedef struct {
+  float x, y; // pixel center, NAN if not connected
+} geo_xy_t;
+
+typedef struct {
+  geo_xy_t pix[GEO_SIZE];
+} geo_map_t;
 
 int setCLKx2(int FkHz); // set PIXLAR CLOCKx2 output frequency, kHz
 int rgb(int r1, int g1, int b1, int r2, int g2, int b2); //values are given in percents 0-100
-int uart54_send(int chan, uint64_t *buf, int num); // send 54-bits word to channel chan (0->A, 1->B)
-int uart54_recv(int chan, uint64_t *buf, int num); // blocks until receive requested num words
+int uart54_send(int chan, uint64_t *buf, int num); // send 54-bits word to channel chan (0->A, 1->B), -1 if TX is not ready for UART_TIMEOUT
+int uart54_recv(int chan, uint64_t *buf, int num); // receives up to num words, gives up UART_TIMEOUT after last word; returns number of words received, -1 on error
+int uart54_recv_timeout(int chan, uint64_t *buf, int num, int timeout_us); // as uart54_recv with timeout_us, UART_FOREVER blocks until num words are received
 int uart54_available(int chan); //returns 1 if word is available in buffer, 0 otherwise
+int uart54_txready(int chan); //returns 1 if TX is ready for next word, 0 if busy
 int system_reset(); //issues system reset pulse for UART and PIXLAR asics
+int setCLKdiv(int div); // set CLOCKx2 divider directly, CLOCKx2=CLK_FBASE/div kHz
+int uart54_bertest(int chan, int nwords, uint64_t *nbits); // loopback test, returns number of bad words (nbits - number of wrong bits), -1 on error
+int clk_calibrate(int divmin, int divmax, int nwords); // scans dividers slow to fast, sets and returns one CALIB_MARGIN steps slower than first failure, -1 if none (previous divider is restored)
+int seq_oplen(uint8_t op); // operand length of sequence opcode, -1 if unknown
+int seq_run(int chan, const uint8_t *prog, int len, seq_stat_t *stat, int *nsteps); // runs program on channel chan, fills per-step stat[SEQ_MAXSTEPS]; returns 0 if OK, failed step index+1, -1 if program is malformed
+int getCLKdiv(); // returns current CLOCKx2 divider, -1 on error
+void ts_init(ts_unwrap_t *u, int div); // resets unwrapper for CLOCKx2 divider div
+uint64_t larpix_packet(int type, int chip, int chan, uint32_t ts, int adc); // builds data packet with valid parity
+uint64_t larpix_config(int chip, int reg, int val); // builds configuration write packet with valid parity
+int larpix_scan(const scan_cfg_t *cfg, scan_cell_t *res); // runs scan, res[step][chip-chip_first][channel]; returns number of steps, -1 on error
+void larpix_decode_word(uint64_t w, larpix_hit_t *hit); // splits word into fields, no timestamp unwrapping
+void ts_unwrap(ts_unwrap_t *u, larpix_hit_t *hit, uint64_t host); // extends hit timestamp to 64 bits and sets its host time; host=0 if unknown
+int larpix_decode(ts_unwrap_t *u, const uint64_t *words, const uint64_t *host, int n, larpix_hit_t *hits); // decodes n words, host[] may be NULL; returns n
+int geo_load(geo_map_t *g, const char *fname); // loads geometry file, lines "<uart> <chip> <channel> <x> <y>", uart -1 for both; returns number of lines loaded, -1 on error
+int geo_xy(const geo_map_t *g, const larpix_hit_t *hits, int n, float *x, float *y); // fills hit positions, NAN if unknown; returns number of hits with known position
+uint32_t state_checksum(const larpix_state_t *st); // checksum of chip configuration (written registers only)
+int state_save(const larpix_state_t *st, const char *fname); // saves state atomically, returns 0 on success, -1 on error
+int state_load(larpix_state_t *st, const char *fname); // returns number of configured registers, -1 if file is missing or corrupt
+int bitstream_fingerprint(char *buf, int len); // reads load token of bitstream (md5 and load time), -1 if unknown
 
-
+#endif
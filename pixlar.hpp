@@ -0,0 +1,184 @@
+// Header-only C++ register access for PIXLAR board.
+// Call pixlar::map() once, then every register access is a single volatile
+// load or store at a compile-time offset from the mapped base:
+//
+//   pixlar::map();
+//   pixlar::Uart54A::send(w);
+//   uint64_t r; if(pixlar::Uart54B::recv(r)) ...
+//
+// Addresses come from pixlar.h, so C and C++ tools always agree on them.
+#ifndef PIXLAR_HPP
+#define PIXLAR_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "pixlar.h"
+}
+
+namespace pixlar {
+
+// All register blocks live in one AXI window: CLOCKx2/reset, UART A, UART B, LEDs
+constexpr uintptr_t AXI_BASE = CLOCKx2_DIVIDER;
+constexpr size_t AXI_SPAN = 0x40000;
+
+namespace detail {
+// template static member gives one definition of the base pointer across translation units
+template <typename D = void> struct Base { static volatile uint8_t *ptr; };
+template <typename D> volatile uint8_t *Base<D>::ptr = nullptr;
+
+inline uint64_t mono_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+}
+
+inline bool mapped() { return detail::Base<>::ptr != nullptr; }
+
+inline int map() // maps register window, returns 0 on success, -1 on error
+{
+    if(mapped()) return 0;
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) {
+        perror("Can't open /dev/mem");
+        return -1;
+    }
+    void *mem = mmap(NULL, AXI_SPAN, PROT_READ | PROT_WRITE, MAP_SHARED, fd, AXI_BASE);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return -1;
+    }
+    detail::Base<>::ptr = static_cast<volatile uint8_t *>(mem);
+    return 0;
+}
+
+inline void unmap()
+{
+    if(!mapped()) return;
+    munmap((void *)detail::Base<>::ptr, AXI_SPAN);
+    detail::Base<>::ptr = nullptr;
+}
+
+// Register of type T at address Addr with Bits significant bits
+template <uintptr_t Addr, typename T, unsigned Bits = sizeof(T) * 8>
+struct Reg {
+    static_assert(Addr >= AXI_BASE && Addr + sizeof(T) <= AXI_BASE + AXI_SPAN, "register outside of mapped window");
+    static_assert(Addr % sizeof(T) == 0, "misaligned register");
+    static_assert(Bits > 0 && Bits <= sizeof(T) * 8, "register width exceeds access type");
+
+    typedef T type;
+    static constexpr uintptr_t addr = Addr;
+    static constexpr uintptr_t offset = Addr - AXI_BASE;
+    static constexpr unsigned bits = Bits;
+    static constexpr T mask = Bits == sizeof(T) * 8 ? T(~T(0)) : T((T(1) << Bits) - 1);
+
+    static volatile T &ref() { return *reinterpret_cast<volatile T *>(detail::Base<>::ptr + offset); }
+    static T read() { return ref(); }
+    static void write(T v) { ref() = v; }
+
+    template <uint64_t V> static void write() // constant write, width checked at compile time
+    {
+        static_assert(V <= mask, "value does not fit in register");
+        ref() = T(V);
+    }
+};
+
+// CLOCKx2 generator and reset
+typedef Reg<CLOCKx2_DIVIDER, uint32_t> ClockDivider; // holds divider-1
+typedef Reg<SYSTEM_RESET, uint32_t, 1> SystemReset;
+
+inline void set_clock_div(uint32_t div) { ClockDivider::write(div - 1); } // CLOCKx2=CLK_FBASE/div kHz
+
+inline void system_reset() // reset pulse for UART and PIXLAR asics
+{
+    SystemReset::write<1>();
+    usleep(1000);
+    SystemReset::write<0>();
+}
+
+// 54-bit UART, Chan 0->A, 1->B. Bit 63 (top bit of byte 7) is TX ready on send register and data_ready on receive register.
+template <unsigned Chan>
+struct Uart54 {
+    static_assert(Chan < 2, "UART channel must be 0 (A) or 1 (B)");
+
+    static constexpr uintptr_t SEND = Chan == 0 ? UART54_A_SEND : UART54_B_SEND;
+    static constexpr uintptr_t RECV = Chan == 0 ? UART54_A_RECV : UART54_B_RECV;
+
+    typedef Reg<SEND, uint64_t> Tx;
+    typedef Reg<RECV, uint64_t> Rx;
+    typedef Reg<SEND + 7, uint8_t> TxStatus;
+    typedef Reg<RECV + 7, uint8_t> RxStatus;
+
+    static bool tx_ready() { return TxStatus::read() >= 0x80; }
+    static bool available() { return RxStatus::read() >= 0x80; }
+
+    static constexpr unsigned FOREVER = unsigned(UART_FOREVER); // timeout value that blocks
+
+    static bool wait_tx(unsigned timeout_us) // clock is read only if TX is busy
+    {
+        if(tx_ready()) return true;
+        uint64_t t = detail::mono_us();
+        while(!tx_ready())
+            if(detail::mono_us() - t >= timeout_us) return false;
+        return true;
+    }
+
+    static bool send(uint64_t w, unsigned timeout_us = UART_TIMEOUT) // false if TX is stalled
+    {
+        if(!wait_tx(timeout_us)) return false;
+        Tx::write(w);
+        return true;
+    }
+    static size_t send(const uint64_t *buf, size_t num) // returns number of words sent
+    {
+        for(size_t i = 0; i < num; i++)
+            if(!send(buf[i])) return i;
+        return num;
+    }
+
+    static bool try_recv(uint64_t &w) // non-blocking, returns false if no word
+    {
+        if(!available()) return false;
+        w = Rx::read();
+        RxStatus::write(0); // reset data_ready bit
+        return true;
+    }
+    static bool recv(uint64_t &w, unsigned timeout_us = UART_TIMEOUT) // false if no word in timeout_us, FOREVER blocks
+    {
+        if(try_recv(w)) return true;
+        uint64_t t = detail::mono_us();
+        while(!try_recv(w))
+            if(timeout_us != FOREVER && detail::mono_us() - t >= timeout_us) return false;
+        return true;
+    }
+    static size_t recv(uint64_t *buf, size_t num, unsigned timeout_us = UART_TIMEOUT) // gives up timeout_us after last word, returns number of words received
+    {
+        for(size_t i = 0; i < num; i++)
+            if(!recv(buf[i], timeout_us)) return i;
+        return num;
+    }
+};
+
+typedef Uart54<0> Uart54A;
+typedef Uart54<1> Uart54B;
+
+// RGB LEDs, 16-bit PWM values
+typedef Reg<LED1_B, uint16_t> Led1B;
+typedef Reg<LED1_G, uint16_t> Led1G;
+typedef Reg<LED1_R, uint16_t> Led1R;
+typedef Reg<LED2_B, uint16_t> Led2B;
+typedef Reg<LED2_G, uint16_t> Led2G;
+typedef Reg<LED2_R, uint16_t> Led2R;
+
+} // namespace pixlar
+
+#endif
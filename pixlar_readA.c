@@ -11,7 +11,7 @@ int main() {
     uint64_t w;
 //   if(uart54_available(0)) 
 //    {
-    uart54_recv(0, &w, 1);
+    if(uart54_recv(0, &w, 1)<1) { printf("A: no data\n"); return 1; }
     printf("A: 0x%0llx\n",w);
  //   }
 /*
@@ -11,7 +11,7 @@ int main() {
     uint64_t w;
 //   if(uart54_available(0)) 
 //    {
-    uart54_recv(1, &w, 1);
+    if(uart54_recv(1, &w, 1)<1) { printf("B: no data\n"); return 1; }
     printf("B: 0x%0llx\n",w);
  //   }
 /*
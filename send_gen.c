@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include "pixlar.h"
+
+// Paced traffic generator for UART channels A and B, replaces send_loopA/send_loopB
+
+#define SPIN_NS 100000 // deadlines closer than this are waited by spinning, not sleeping
+
+enum {MODE_CONST, MODE_POISSON, MODE_BURST};
+enum {PAY_COUNTER, PAY_LARPIX, PAY_FIXED};
+
+int mode=MODE_CONST, payload=PAY_COUNTER, burst=16, dryrun=0;
+double rate=1000; // requested words/s per channel
+double tmax=0;    // run time, s
+double tick=200;  // LArPix timestamp tick, ns
+uint64_t fixed=0;
+volatile sig_atomic_t stop=0;
+
+typedef struct {
+  int chan;
+  pthread_t thread;
+  uint64_t sent;    // words sent
+  uint64_t late;    // words sent more than SPIN_NS after their deadline
+  double maxlate;   // worst lateness, us
+  double elapsed;   // s
+} gen_t;
+
+void usage()
+{
+ printf("Sends paced words to UART channels.\n Usage: ");
+ printf("send_gen [-c A|B|AB] [-r <words/s>] [-m const|poisson|burst] [-b <burst length>] [-p counter|larpix|<word>] [-t <seconds>] [-n]\n");
+ printf("-r: average rate per channel, 1000 by default.\n");
+ printf("-m: constant intervals, Poisson intervals or bursts of -b words at full speed.\n");
+ printf("-p: incrementing counter, LArPix data packets with valid parity, or fixed word.\n");
+ printf("-t: run time, forever by default (stop with Ctrl-C). -n: dry run without hardware.\n");
+}
+
+void onsignal(int sig) { stop=1; }
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+void wait_until(uint64_t t) // sleeps to SPIN_NS before deadline, then spins
+{
+    struct timespec ts;
+    if(t>now_ns()+SPIN_NS)
+    {
+      t-=SPIN_NS;
+      ts.tv_sec=t/1000000000ULL; ts.tv_nsec=t%1000000000ULL;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      t+=SPIN_NS;
+    }
+    while(now_ns()<t) {}
+}
+
+uint64_t xorshift(uint64_t *s)
+{
+    *s^=*s<<13; *s^=*s>>7; *s^=*s<<17;
+    return *s;
+}
+
+void *generate(void *arg)
+{
+    gen_t *g=arg;
+    off_t offset = g->chan==0 ? UART54_A_SEND : UART54_B_SEND;
+    size_t len = 8;
+    volatile unsigned char *mem=NULL;
+    off_t page_offset=0;
+    uint64_t seed=0x9e3779b97f4a7c15ULL*(g->chan+1), w=0, r;
+    double tnext, dt=1e9/rate;
+    int i, n;
+
+    if(!dryrun)
+    {
+    // Truncate offset to a multiple of the page size, or mmap will fail.
+    size_t pagesize = sysconf(_SC_PAGE_SIZE);
+    off_t page_base = (offset / pagesize) * pagesize;
+    page_offset = offset - page_base;
+
+    int fd = open("/dev/mem", O_RDWR | O_SYNC);
+    mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("Can't map memory");
+        return NULL;
+    }
+    }
+
+    uint64_t t0=now_ns(), t;
+    tnext=0;
+    while(!stop)
+    {
+      wait_until(t0+(uint64_t)tnext);
+      t=now_ns();
+      if(t-t0>tnext+SPIN_NS)
+      {
+        g->late++;
+        if((t-t0-tnext)/1e3>g->maxlate) g->maxlate=(t-t0-tnext)/1e3;
+      }
+      n= mode==MODE_BURST ? burst : 1;
+      for(i=0; i<n; i++)
+      {
+        if(payload==PAY_COUNTER) w++;
+        else if(payload==PAY_FIXED) w=fixed;
+        else
+        {
+          r=xorshift(&seed);
+          w=larpix_packet(PKT_DATA, r&0xff, (r>>8)&0x1f, (uint32_t)((t-t0)/tick), (r>>16)&0x3ff);
+        }
+        if(!dryrun)
+        {
+          uint64_t tw=now_ns();
+          while( *(mem+page_offset+7)<0x80 && now_ns()-tw<UART_TIMEOUT*1000ULL) {}
+          if( *(mem+page_offset+7)<0x80) { printf("Channel %c: TX stalled, stopping\n", g->chan ? 'B' : 'A'); stop=1; break; }
+          *((volatile uint64_t*)(mem+page_offset))=w;
+        }
+      }
+      g->sent+=i;
+      if(tmax>0 && t-t0>=tmax*1e9) break;
+      // next deadline
+      if(mode==MODE_POISSON) tnext+=-log(1.0-(xorshift(&seed)>>11)*(1.0/9007199254740992.0))*dt;
+      else tnext+=dt*n;
+    }
+    g->elapsed=(now_ns()-t0)/1e9;
+    if(!dryrun) munmap((void*)mem, page_offset + len);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+
+    gen_t gen[2];
+    int nch=0, chans=1, opt, i, div=5;
+    while((opt=getopt(argc,argv,"c:r:m:b:p:t:nh"))!=-1)
+    {
+      switch(opt)
+      {
+        case 'c': chans=(strchr(optarg,'A')||strchr(optarg,'a') ? 1 : 0) | (strchr(optarg,'B')||strchr(optarg,'b') ? 2 : 0); break;
+        case 'r': rate=strtod(optarg,NULL); break;
+        case 'm':
+          if(strcmp(optarg,"const")==0) mode=MODE_CONST;
+          else if(strcmp(optarg,"poisson")==0) mode=MODE_POISSON;
+          else if(strcmp(optarg,"burst")==0) mode=MODE_BURST;
+          else {usage(); return 0;}
+          break;
+        case 'b': burst=atoi(optarg); break;
+        case 'p':
+          if(strcmp(optarg,"counter")==0) payload=PAY_COUNTER;
+          else if(strcmp(optarg,"larpix")==0) payload=PAY_LARPIX;
+          else {payload=PAY_FIXED; fixed=strtoull(optarg,NULL,0);}
+          break;
+        case 't': tmax=strtod(optarg,NULL); break;
+        case 'n': dryrun=1; break;
+        default: usage(); return 0;
+      }
+    }
+    if(chans==0 || rate<=0 || burst<1 || optind<argc) {usage(); return 0;}
+
+    signal(SIGINT, onsignal);
+    if(!dryrun && (div=getCLKdiv())<1) return -1;
+    tick=1e6*div*TS_CLKDIV/CLK_FBASE;
+
+    for(i=0; i<2; i++)
+      if(chans&(1<<i))
+      {
+        memset(&gen[nch],0,sizeof(gen_t));
+        gen[nch].chan=i;
+        if(pthread_create(&gen[nch].thread,NULL,generate,&gen[nch])!=0) {perror("Can't start thread"); return -1;}
+        nch++;
+      }
+    for(i=0; i<nch; i++) pthread_join(gen[i].thread,NULL);
+
+    printf("chan   requested,w/s    achieved,w/s        sent      late  max late,us\n");
+    for(i=0; i<nch; i++)
+      printf("%4c %16.1f %15.1f %11llu %9llu %12.1f\n", gen[i].chan ? 'B' : 'A', rate,
+             gen[i].elapsed>0 ? gen[i].sent/gen[i].elapsed : 0, (long long unsigned)gen[i].sent, (long long unsigned)gen[i].late, gen[i].maxlate);
+    return 0;
+}
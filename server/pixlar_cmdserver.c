@@ -14,15 +14,52 @@
 #include <net/if.h>
 #include <netinet/ether.h>
 #include <sys/timeb.h>
+#include <sys/stat.h>
 #include "pixlar.c"
 #include <time.h>
 
+#define CMDQ_LEN 256     // hardware command queue length
+#define CMDQ_CLIENT 32   // max queued commands per client
+#define CMD_MAXLEN 65536 // max command length, binary commands carry programs
+#define ID_MAXLEN 255    // max client identity / request ID length
+#define PAUSE_TIMEOUT 2000 // max wait for pixlar_dataserver to acknowledge PAUSE, ms
+#define PAUSE_SLACK 5000   // added to estimated pause length sent with PAUSE, ms
+#define SEQ_MAXUS 1000000000000ULL // cap of sequence run time estimate, us
+
 void *context = NULL;
 
 //  Socket to respond to clients
 void *responder = NULL;
+//  Socket to pass commands to pixlar_dataserver
+void *datactl = NULL;
+//  Socket to receive acknowledgements from pixlar_dataserver
+void *dataack = NULL;
+uint32_t npause=0; // PAUSE sequence number, acknowledgement must carry the same
+int runopen=0;     // DAQ_BEG sent, DAQ_END not yet
+uint32_t curun=0;  // current or last run number
 struct timeb mstime0, mstime1;
 
+// Queued client request. Clients may be REQ (identity, empty delimiter, command) 
+// or DEALER (identity, [empty delimiter], [request ID], command); the reply repeats the envelope and request ID.
+typedef struct {
+  uint8_t id[ID_MAXLEN]; size_t idlen;    // ROUTER identity of the client
+  int delim;                              // 1 if client sent empty delimiter frame
+  uint8_t rid[ID_MAXLEN]; size_t ridlen;  // request ID, ridlen=0 if not given
+  char *cmd; size_t cmdlen;               // command "CMDNAME ARG" or "CMDNAME" + binary data from 8-th byte
+} cmdreq_t;
+
+cmdreq_t cmdq[CMDQ_LEN]; // serialised hardware command queue
+int qhead=0, qlen=0;
+
+#define RESBUF_LEN (8+SCAN_MAXCELLS*sizeof(scan_cell_t))
+uint8_t resbuf[RESBUF_LEN]; // binary part of reply, large enough for seq and scan results
+size_t reslen=0;
+
+// last known hardware state, restored after system_reset by Recover() and kept in STATE_FILE for warm restart
+larpix_state_t hw;
+int dirty=0;              // hw changed since last save
+uint64_t replay[256*256]; // configuration words to replay on one channel
+
 void printdate()
 {
     char str[64];
@@ -32,65 +69,405 @@ void printdate()
     printf("%s ", str); 
 }
 
+void Remember(int src, uint64_t w) // keeps configuration writes for replay
+{
+  if(PKT_TYPE(w)!=PKT_CFGW) return;
+  hw.val[src][PKT_CHIP(w)][PKT_REG(w)]=PKT_REGDATA(w);
+  hw.set[src][PKT_CHIP(w)][PKT_REG(w)]=1;
+  dirty=1;
+}
+
+int Recover(int chan, int force) // resets UARTs and asics, restores clock divider and chip configuration; without force only if TX of chan is stuck
+{
+  uint64_t t0=mono_us();
+  int src, chip, reg, n, nw=0, rv=1;
+  if(!force && uart54_txready(chan)==1)
+   {
+    printf("recovery of channel %c: TX is ready, no reset needed ", chan ? 'B' : 'A');
+    return 1;
+   }
+  system_reset();
+  if(hw.clkdiv>0) setCLKdiv(hw.clkdiv);
+  for(src=0; src<2; src++) // reset hits both channels
+   {
+    n=0;
+    for(chip=0; chip<256; chip++)
+      for(reg=0; reg<256; reg++)
+        if(hw.set[src][chip][reg]) replay[n++]=larpix_config(chip, reg, hw.val[src][chip][reg]);
+    if(n && uart54_send(src, replay, n)<0) rv=0;
+    nw+=n;
+   }
+  printf("recovery of channel %c: reset, divider %d, %d configuration words replayed in %.1f ms, %s ", chan ? 'B' : 'A',
+         hw.clkdiv, nw, (mono_us()-t0)/1e3, rv ? "OK" : "TX stalled");
+  return rv;
+}
+
 int SetFreq(int freq)
 {
-  setCLKx2(freq);
+  if(setCLKx2(freq)<0) return 0;
+  hw.clkdiv=CLK_FBASE/freq; dirty=1;
   return 1;
 }
 
-int SendWord(uint64_t wd)
+int DaqPause(int on, uint64_t maxms) // stops pixlar_dataserver reading UARTs for up to maxms+PAUSE_SLACK, so words read back here are not stolen; returns 0 if pause is not acknowledged
+{
+  char msg[32], ack[32];
+  int rv;
+  uint64_t t0=mono_us();
+  zmq_pollitem_t item={dataack, 0, ZMQ_POLLIN, 0};
+  if(!on) { zmq_send (datactl, "RESUME", 6, ZMQ_DONTWAIT); return 1; }
+  while(zmq_recv (dataack, ack, sizeof(ack), ZMQ_DONTWAIT)>=0) ; // drop late acknowledgements of earlier pauses
+  npause++;
+  snprintf(msg, sizeof(msg), "PAUSE %u %llu", npause, (long long unsigned)(maxms+PAUSE_SLACK));
+  if(zmq_send (datactl, msg, strlen(msg), ZMQ_DONTWAIT)<0) return 1; // pixlar_dataserver is not running, nobody reads UARTs
+  snprintf(msg, sizeof(msg), "PAUSED %u", npause);
+  while(mono_us()-t0<PAUSE_TIMEOUT*1000ULL)
+   {
+    if(zmq_poll (&item, 1, PAUSE_TIMEOUT-(mono_us()-t0)/1000)<=0) continue;
+    rv=zmq_recv (dataack, ack, sizeof(ack)-1, ZMQ_DONTWAIT);
+    if(rv<0) continue;
+    ack[rv<(int)sizeof(ack)-1 ? rv : (int)sizeof(ack)-1]=0;
+    if(strcmp(ack, msg)==0) return 1;
+   }
+  zmq_send (datactl, "RESUME", 6, ZMQ_DONTWAIT); // in case PAUSE arrives later
+  printf("pixlar_dataserver did not acknowledge pause in %d ms ", PAUSE_TIMEOUT);
+  return 0;
+}
+
+int ClkScan(int nwords) // calibrate CLOCKx2 divider with loopback test, nwords per channel per step
+{
+  int rv;
+  if(nwords<=0) nwords=CALIB_NWORDS;
+  // worst case: every word waits CALIB_TIMEOUT for TX and for RX
+  if(!DaqPause(1, (uint64_t)(CALIB_DIVMAX-CALIB_DIVMIN+1)*(2*nwords*2*CALIB_TIMEOUT/1000+2))) return 0;
+  rv=clk_calibrate(CALIB_DIVMIN, CALIB_DIVMAX, nwords);
+  DaqPause(0, 0);
+  if(rv>0) { hw.clkdiv=rv; dirty=1; }
+  return rv>=0;
+}
+
+int ScanReg(uint8_t *data, size_t len) // threshold/pedestal scan, data: scan_cfg_t
 {
-  uart54_send(0, &wd, 1);
-  uart54_send(1, &wd, 1);
+  scan_cfg_t cfg;
+  int32_t nsteps, nchips;
+  if(len<sizeof(scan_cfg_t)) return 0;
+  memcpy(&cfg, data, sizeof(cfg));
+  printf("scan of register %d on channel %d chips %d-%d, values %d-%d step %d ", cfg.reg, cfg.src, cfg.chip_first, cfg.chip_last, cfg.start, cfg.stop, cfg.step);
+  if(!DaqPause(1, cfg.step && cfg.stop>=cfg.start ? ((cfg.stop-cfg.start)/cfg.step+1)*((uint64_t)cfg.settle_us+cfg.dwell_us)/1000 : 0)) return 0;
+  nsteps=larpix_scan(&cfg, (scan_cell_t*)(resbuf+8));
+  DaqPause(0, 0);
+  if(nsteps<0) return 0;
+  // scan leaves last value in scanned registers: restore pre-scan values from the shadow, which is not changed
+  int c, ch, n=0, unknown=0;
+  for(c=cfg.chip_first; c<=cfg.chip_last; c++)
+    for(ch=0; ch<(cfg.perchan ? LARPIX_NCHAN : 1); ch++)
+      if(hw.set[cfg.src&1][c][cfg.reg+ch]) replay[n++]=larpix_config(c, cfg.reg+ch, hw.val[cfg.src&1][c][cfg.reg+ch]);
+      else unknown++;
+  if(n && uart54_send(cfg.src, replay, n)<0) { printf("can't restore scanned registers, TX stalled "); return 0; }
+  printf("%d registers restored", n);
+  if(unknown) printf(", %d never configured left at last scan value", unknown);
+  printf(" ");
+  // reply: int32 number of steps, int32 number of chips, scan_cell_t[step][chip][channel]
+  nchips=cfg.chip_last-cfg.chip_first+1;
+  memcpy(resbuf, &nsteps, 4);
+  memcpy(resbuf+4, &nchips, 4);
+  reslen=8+nsteps*nchips*LARPIX_NCHAN*sizeof(scan_cell_t);
   return 1;
 }
 
+int SeqReadback(const uint8_t *prog, size_t len, uint64_t *maxus) // returns 1 if program has SEQ_EXPECT steps; maxus: worst-case run time
+{
+  uint64_t mult[SEQ_MAXDEPTH+1]; // iterations of enclosing loops
+  uint32_t u32, to;
+  size_t p=0;
+  int l, depth=0, expect=0;
+  mult[0]=1; *maxus=0;
+  while(p<len)
+   {
+    l=seq_oplen(prog[p]);
+    if(l<0 || p+1+l>len) break; // malformed, seq_run rejects it
+    u32=0;
+    if(l>=4) memcpy(&u32, prog+p+1, 4);
+    switch(prog[p])
+     {
+      case SEQ_SEND: *maxus+=mult[depth]*UART_TIMEOUT; break;
+      case SEQ_WAIT: *maxus+=mult[depth]*u32; break;
+      case SEQ_EXPECT: memcpy(&to, prog+p+17, 4); *maxus+=mult[depth]*to; expect=1; break;
+      case SEQ_LOOP:
+        if(depth<SEQ_MAXDEPTH) { mult[depth+1]= mult[depth]*u32<SEQ_MAXUS ? mult[depth]*u32 : SEQ_MAXUS; depth++; }
+        break;
+      case SEQ_ENDLOOP: if(depth>0) depth--; break;
+      default: *maxus+=mult[depth]*1000; // reset, divider
+     }
+    p+=1+l;
+   }
+  return expect;
+}
 
-int main (int argc, char **argv)
+int RunSeq(uint8_t *data, size_t len) // runs command sequence, data: channel byte followed by program
 {
+  int32_t rv;
+  int32_t nsteps;
+  if(len<1) return 0;
+  uint64_t maxus;
+  int readback=SeqReadback(data+1, len-1, &maxus);
+  if(readback && !DaqPause(1, maxus/1000)) return 0;
+  rv=seq_run(data[0], data+1, len-1, (seq_stat_t*)(resbuf+8), &nsteps);
+  if(readback) DaqPause(0, 0);
+  // remember configuration words and divider set by executed steps
+  size_t p=1;
+  int i;
+  seq_stat_t st;
+  uint64_t w;
+  uint32_t div;
+  for(i=0; i<nsteps && p<len; i++)
+   {
+    memcpy(&st, resbuf+8+i*sizeof(seq_stat_t), sizeof(st));
+    if(st.count && data[p]==SEQ_SEND) { memcpy(&w, data+p+1, 8); Remember(data[0]&1, w); }
+    if(st.count && data[p]==SEQ_SETDIV) { memcpy(&div, data+p+1, 4); hw.clkdiv=div; dirty=1; }
+    p+=1+seq_oplen(data[p]);
+   }
+  printf("sequence of %d steps on channel %d: %s (%d) ", nsteps, data[0], rv==0 ? "OK" : "FAILED", rv);
+  // reply: int32 result, int32 number of steps, per-step seq_stat_t
+  memcpy(resbuf, &rv, 4);
+  memcpy(resbuf+4, &nsteps, 4);
+  reslen=8+nsteps*sizeof(seq_stat_t);
+  return rv==0;
+}
 
-int rv;
-context = zmq_ctx_new();
+int RecDump() // asks pixlar_dataserver to dump its flight recorder
+{
+  if(zmq_send (datactl, "RECDUMP", 7, ZMQ_DONTWAIT)<0) return 0;
+  return 1;
+}
 
-//  Socket to respond to clients
-responder = zmq_socket (context, ZMQ_REP);
-rv=zmq_bind (responder, "tcp://*:5555");
-if(rv<0) {printdate(); printf("Can't bind tcp socket for command! Exiting.\n"); return 0;}
-printdate(); printf ("pixlar_server: listening at tcp://5555\n");
+int DaqRun(int type, uint32_t run) // asks pixlar_dataserver to insert run marker into data stream
+{
+  char msg[40];
+  if(type==MARK_END && (!runopen || run!=curun)) { printf("run %u is not open ", run); return 0; }
+  if(type==MARK_BEG && runopen) snprintf(msg, sizeof(msg), "DAQ_BEG %u %u", run, curun); // back-to-back: previous run ends right before the new one begins
+  else snprintf(msg, sizeof(msg), "%s %u", type==MARK_BEG ? "DAQ_BEG" : "DAQ_END", run);
+  if(zmq_send (datactl, msg, strlen(msg), ZMQ_DONTWAIT)<0) return 0;
+  runopen= type==MARK_BEG;
+  curun=run;
+  printf("%s ", msg);
+  return 1;
+}
 
+int ConfSum() // reply data: uint32 configuration checksum, int32 divider
+{
+  uint32_t sum=state_checksum(&hw);
+  memcpy(resbuf, &sum, 4);
+  memcpy(resbuf+4, &hw.clkdiv, 4);
+  reslen=8;
+  printf("configuration checksum 0x%08x, divider %d ", sum, hw.clkdiv);
+  return 1;
+}
 
-zmq_msg_t request;
+void SaveState()
+{
+  if(state_save(&hw, STATE_FILE)<0) { printdate(); printf("Can't save state to %s\n", STATE_FILE); }
+  dirty=0;
+}
 
-char cmd[32]; //command string
-uint64_t arg=0;
+void StartHardware() // warm start if loaded bitstream and divider match saved state, restore saved state otherwise
+{
+  uint64_t t0=mono_us(), t1;
+  char fp[64]="";
+  int n, div, known;
+  mkdir(STATE_DIR, 0755);
+  n=state_load(&hw, STATE_FILE);
+  known=bitstream_fingerprint(fp, sizeof(fp))==0; // no load token: FPGA state unknown, never warm
+  div=getCLKdiv();
+  t1=mono_us();
+  printdate(); printf("startup: state %s (%d registers), bitstream %s, divider %d, %.1f ms\n", n<0 ? "not found" : "loaded", n<0 ? 0 : n,
+                      fp[0] ? fp : "unknown", div, (t1-t0)/1e3);
+  if(n>=0 && known && strcmp(fp, hw.bitstream)==0 && div==hw.clkdiv)
+   {
+    printdate(); printf("startup: warm, hardware state matches, configuration checksum 0x%08x kept\n", state_checksum(&hw));
+    return;
+   }
+  if(n>0 || hw.clkdiv>0)
+   {
+    printdate(); printf("startup: cold, restoring saved state: ");
+    Recover(0, 1);
+    printf("\n");
+   }
+  else
+   {
+    memset(&hw, 0, sizeof(hw));
+    hw.clkdiv=div;
+   }
+  snprintf(hw.bitstream, sizeof(hw.bitstream), "%s", fp);
+  SaveState();
+  printdate(); printf("startup: hardware ready in %.1f ms\n", (mono_us()-t1)/1e3);
+}
+
+int SendWord(uint64_t wd)
+{
+  int chan, rv=1;
+  for(chan=0; chan<2; chan++)
+   {
+    Remember(chan, wd);
+    if(uart54_send(chan, &wd, 1)==0) continue;
+    // TX stalled: recover and retry once
+    if(Recover(chan, 0) && uart54_send(chan, &wd, 1)==0) continue;
+    rv=0;
+   }
+  return rv;
+}
 
-while (1) {  // main loop
 
-//Check next request from client
-zmq_msg_init (&request);
-//if(zmq_msg_recv (&request, responder, ZMQ_DONTWAIT)==-1) {zmq_msg_close (&request);  polldata(); senddata(); sendstats(); sendstats2(); usleep(polldelay*1000); continue;} 
-if(zmq_msg_recv (&request, responder, ZMQ_DONTWAIT)==-1) continue; 
-memcpy(cmd,(char*)zmq_msg_data(&request),7); cmd[7]=0;
-arg=strtoull((char*)(zmq_msg_data(&request)+8), NULL, 0);
+int ExecCmd(char *str, size_t len) // executes command, returns >0 if OK
+{
+char cmd[32]; //command string
+uint64_t arg=0;
+int rv=0;
+strncpy(cmd,str,7); cmd[7]=0;
+reslen=0;
+if(strcmp(cmd, "RUN_SEQ")==0)
+ {
+  printdate(); printf ("Received Command %s  ",cmd);
+  return len>8 ? RunSeq((uint8_t*)str+8, len-8) : 0;
+ }
+if(strcmp(cmd, "SCANREG")==0)
+ {
+  printdate(); printf ("Received Command %s  ",cmd);
+  return len>8 ? ScanReg((uint8_t*)str+8, len-8) : 0;
+ }
+if(strlen(str)>8) arg=strtoull(str+8, NULL, 0);
 printdate(); printf ("Received Command %s %lld  ",cmd, arg );
-rv=0;
  if(strcmp(cmd, "SETFREQ")==0) rv=SetFreq((int)arg); //get 8-th byte of message - start of argument
  else if (strcmp(cmd, "SNDWORD")==0) rv=SendWord(arg);
- else if (strcmp(cmd, "DAQ_BEG")==0) ;//rv=startDAQ(*(uint8_t*)(zmq_msg_data(&request)+8));
- else if (strcmp(cmd, "DAQ_END")==0) ;//rv=stopDAQ(*(uint8_t*)(zmq_msg_data(&request)+8));
+ else if (strcmp(cmd, "CLKSCAN")==0) rv=ClkScan((int)arg);
+ else if (strcmp(cmd, "RECDUMP")==0) rv=RecDump();
+ else if (strcmp(cmd, "RECOVER")==0) rv=Recover((int)arg&1, (arg&RECOVER_FORCE)!=0);
+ else if (strcmp(cmd, "CONFSUM")==0) rv=ConfSum();
+ else if (strcmp(cmd, "DAQ_BEG")==0) rv=DaqRun(MARK_BEG, (uint32_t)arg);
+ else if (strcmp(cmd, "DAQ_END")==0) rv=DaqRun(MARK_END, (uint32_t)arg);
  else if (strcmp(cmd, "SETCONF")==0) ;//rv=configu(*(uint8_t*)(zmq_msg_data(&request)+8), (uint8_t*)(zmq_msg_data(&request)+9), zmq_msg_size (&request)-9); 
  else if (strcmp(cmd, "GET_SCR")==0) ;//rv=getSCR(*(uint8_t*)(zmq_msg_data(&request)+8),buf); 
+return rv;
+}
 
-//  Send reply back to client
-zmq_msg_t reply;
+int RecvRequest(cmdreq_t *req) // reads one multipart request without blocking, returns 1 if valid, 0 if malformed, -1 if none
+{
+zmq_msg_t frame[5]; // up to 4 frames kept, last one receives extra frames
+int nf=0, more=1, extra=0, i, k;
+size_t sz;
+while(more)
+ {
+  zmq_msg_init (&frame[nf]);
+  if(zmq_msg_recv (&frame[nf], responder, ZMQ_DONTWAIT)==-1) {zmq_msg_close (&frame[nf]); break;}
+  more=zmq_msg_more (&frame[nf]);
+  if(nf<4) nf++; else { zmq_msg_close (&frame[nf]); extra=1; } // more than 4 frames: malformed
+ }
+if(nf==0) return -1;
+// frame 0 is identity, then optional empty delimiter, then optional request ID and command
+sz=zmq_msg_size(&frame[0]); if(sz>ID_MAXLEN) sz=ID_MAXLEN;
+memcpy(req->id, zmq_msg_data(&frame[0]), sz); req->idlen=sz;
+k=1;
+req->delim=(nf>1 && zmq_msg_size(&frame[1])==0);
+if(req->delim) k++;
+req->ridlen=0; req->cmd=NULL; req->cmdlen=0;
+if(nf-k==2)
+ {
+  sz=zmq_msg_size(&frame[k]); if(sz>ID_MAXLEN) sz=ID_MAXLEN;
+  memcpy(req->rid, zmq_msg_data(&frame[k]), sz); req->ridlen=sz;
+  k++;
+ }
+if(nf-k==1)
+ {
+  sz=zmq_msg_size(&frame[k]);
+  if(sz>0 && sz<=CMD_MAXLEN && (req->cmd=malloc(sz+1))!=NULL)
+   {
+    memcpy(req->cmd, zmq_msg_data(&frame[k]), sz); req->cmd[sz]=0; req->cmdlen=sz;
+   }
+  k++;
+ }
+for(i=0; i<nf; i++) zmq_msg_close (&frame[i]);
+if(extra || k!=nf || req->cmd==NULL) {free(req->cmd); req->cmd=NULL; return 0;}
+return 1;
+}
 
- zmq_msg_init_size (&reply, 5);
- if(rv>0) sprintf(zmq_msg_data (&reply), "OK");
- else sprintf(zmq_msg_data (&reply), "ERR");
- 
-printf("Sending reply %s\n",(char*)zmq_msg_data (&reply));
+void SendReply(cmdreq_t *req, const char *txt, void *data, size_t len) // status text padded to 5 bytes, followed by binary data
+{
+zmq_send (responder, req->id, req->idlen, ZMQ_SNDMORE);
+if(req->delim) zmq_send (responder, "", 0, ZMQ_SNDMORE);
+if(req->ridlen) zmq_send (responder, req->rid, req->ridlen, ZMQ_SNDMORE);
+zmq_msg_t reply;
+ zmq_msg_init_size (&reply, 5+len);
+ memset(zmq_msg_data (&reply), 0, 5);
+ strcpy(zmq_msg_data (&reply), txt);
+ if(len) memcpy((char*)zmq_msg_data (&reply)+5, data, len);
 zmq_msg_send (&reply, responder, 0);
 zmq_msg_close (&reply);
+}
+
+int ClientQueued(cmdreq_t *req) // number of queued commands from the same client
+{
+int i, n=0;
+cmdreq_t *q;
+for(i=0; i<qlen; i++)
+ {
+  q=&cmdq[(qhead+i)%CMDQ_LEN];
+  if(q->idlen==req->idlen && memcmp(q->id, req->id, req->idlen)==0) n++;
+ }
+return n;
+}
+
+int main (int argc, char **argv)
+{
+
+int rv;
+uint64_t tstart=mono_us();
+context = zmq_ctx_new();
+
+//  Socket to respond to clients
+responder = zmq_socket (context, ZMQ_ROUTER);
+rv=zmq_bind (responder, "tcp://*:5555");
+if(rv<0) {printdate(); printf("Can't bind tcp socket for command! Exiting.\n"); return 0;}
+printdate(); printf ("pixlar_server: listening at tcp://5555\n");
+datactl = zmq_socket (context, ZMQ_PUSH);
+int immediate=1; // queue only to connected pixlar_dataserver, so sending fails if it is not running
+zmq_setsockopt (datactl, ZMQ_IMMEDIATE, &immediate, sizeof(immediate));
+zmq_connect (datactl, DATA_CTL);
+dataack = zmq_socket (context, ZMQ_PULL);
+zmq_connect (dataack, DATA_ACK);
+StartHardware();
+zmq_send (datactl, "RESUME", 6, ZMQ_DONTWAIT); // previous instance may have died during a pause
+printdate(); printf ("pixlar_server: ready in %.1f ms\n", (mono_us()-tstart)/1e3);
+
+cmdreq_t req;
+zmq_pollitem_t items[1];
+items[0].socket=responder; items[0].fd=0; items[0].events=ZMQ_POLLIN; items[0].revents=0;
+
+while (1) {  // main loop
+
+// wait for requests only if there is nothing to execute
+zmq_poll (items, 1, qlen>0 ? 0 : -1);
+
+// queue all pending requests, so clients can pipeline commands while hardware is busy
+while((rv=RecvRequest(&req))>=0)
+ {
+  if(rv==0) {SendReply(&req, "ERR", NULL, 0); continue;}
+  if(qlen>=CMDQ_LEN || ClientQueued(&req)>=CMDQ_CLIENT) {SendReply(&req, "BUSY", NULL, 0); free(req.cmd); continue;}
+  cmdq[(qhead+qlen)%CMDQ_LEN]=req;
+  qlen++;
+ }
+
+if(qlen==0) continue;
+
+// execute one command from the queue head
+cmdreq_t *q=&cmdq[qhead];
+rv=ExecCmd(q->cmd, q->cmdlen);
+
+//  Send reply back to client
+printf("Sending reply %s\n", rv>0 ? "OK" : "ERR");
+SendReply(q, rv>0 ? "OK" : "ERR", resbuf, reslen);
+free(q->cmd);
+qhead=(qhead+1)%CMDQ_LEN; qlen--;
+if(dirty && qlen==0) SaveState(); // save once a burst of commands is done
 
 } //end main loop
 
@@ -98,4 +475,3 @@ zmq_msg_close (&reply);
 return 0;
 }
 
-
@@ -15,13 +15,58 @@
 #include <net/if.h>
 #include <netinet/ether.h>
 #include <sys/timeb.h>
+#include <signal.h>
 #include "pixlar.c"
 #include <time.h>
 
+#define REC_MB 64       // default flight recorder size, MB
+#define REC_SEC 10      // default dump window before trigger, s
+#define REC_POST 2      // data recorded after trigger before dump, s
+#define REC_RATEFAC 10  // rate anomaly: 1 s rate differs from running average by this factor
+#define REC_RATEMIN 100 // rate anomaly is checked only above this average rate, words/s
+#define REC_HOLDOFF 60  // min time between automatic dumps, s
+#define POLL_EVERY 4096 // readout loop iterations between control/timer checks
+#define STALL_SEC 2       // channel silent for this long after steady data is stalled, s (only with no-data rule enabled)
+#define STALL_HOLDOFF 10  // min time between recoveries of a channel, s
+
 void *context = NULL;
 
 //  Socket to send data to clients
 void *publisher = NULL;
+//  Socket to receive control messages from pixlar_cmdserver
+void *control = NULL;
+//  Socket to acknowledge PAUSE to pixlar_cmdserver
+void *ack = NULL;
+
+// flight recorder: circular buffer with last received words
+rec_word_t *rec = NULL;
+size_t reclen=0, rechead=0;
+uint64_t recsec=REC_SEC;
+uint64_t trigtime=0;  // time of pending trigger, ns, 0 if none
+time_t trigwall;      // wall clock time of pending trigger, for dump file name
+char trigwhy[16];
+volatile sig_atomic_t exttrig=0;
+int paused=0; // UARTs are read by pixlar_cmdserver, e.g. during scans
+uint64_t pauseend=0; // pause ends by itself at this time, ns, if RESUME never comes
+uint64_t mark[2]; // run markers waiting to be published, in order, ahead of next received word
+int nmark=0, imark=0; // number of pending markers, next one to publish
+
+//  Socket to ask pixlar_cmdserver for recovery of stalled channel
+void *cmdsock = NULL;
+
+// stall watchdog, per channel
+typedef struct {
+  uint64_t last;    // time of last word, ns
+  uint64_t n;       // words in current second
+  double rate;      // average rate, words/s
+  uint64_t txbusy;  // time since TX is not ready, 0 if ready
+  uint64_t stalled; // start of outage, 0 if channel is running
+  uint64_t lastrec; // time of last recovery request
+  uint64_t outages; // number of outages
+  uint64_t deadtime; // total outage time, ns
+} watchdog_t;
+watchdog_t wd[2];
+double stallrate=0; // no-data rule: channel averaging above this rate and then silent is reset, words/s; 0 disables, TX stall is always detected
 
 struct timeb mstime0, mstime1;
 
@@ -56,6 +101,100 @@ zmq_msg_send (&msg, publisher, ZMQ_DONTWAIT);
 zmq_msg_close (&msg);
 }
 
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts); // recorder and decoder time base, not affected by clock adjustments
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+uint64_t record(uint64_t w) // returns time of the word
+{
+    uint64_t t=now_ns();
+    rec[rechead].word=w;
+    rec[rechead].time=t;
+    rechead++; if(rechead==reclen) rechead=0;
+    return t;
+}
+
+void onsignal(int sig) // external trigger
+{
+    exttrig=1;
+}
+
+void printdate();
+
+void trigger(const char *why) // arm dump, it happens REC_POST s later to catch what follows
+{
+    if(trigtime) return;
+    trigtime=now_ns();
+    trigwall=time(NULL);
+    snprintf(trigwhy,sizeof(trigwhy),"%s",why);
+    printdate(); printf("Flight recorder triggered: %s\n",why);
+}
+
+void recdump() // writes recorder window around trigger to a file from forked child, readout continues
+{
+    char fname[128];
+    uint64_t tfrom=trigtime-recsec*1000000000ULL;
+    strftime(fname,sizeof(fname),"pixlar_rec_%Y%m%d_%H%M%S",gmtime(&trigwall));
+    snprintf(fname+strlen(fname),sizeof(fname)-strlen(fname),"_%s.bin",trigwhy);
+    trigtime=0;
+    pid_t pid=fork(); // child gets copy-on-write snapshot of the buffer
+    if(pid<0) {perror("Can't fork recorder dump"); return;}
+    if(pid>0) {printdate(); printf("Dumping flight recorder to %s\n",fname); return;}
+    FILE *f=fopen(fname,"w");
+    if(f==NULL) _exit(1);
+    size_t i, k;
+    for(i=0; i<reclen; i++) // oldest to newest
+     {
+      k=(rechead+i)%reclen;
+      if(rec[k].time<tfrom) continue;
+      fwrite(&rec[k],sizeof(rec_word_t),1,f);
+     }
+    fclose(f);
+    _exit(0);
+}
+
+void gotword(int chan, uint64_t t) // watchdog bookkeeping for received word
+{
+    wd[chan].last=t;
+    wd[chan].n++;
+    if(wd[chan].stalled)
+    {
+      uint64_t dt=t-wd[chan].stalled;
+      wd[chan].stalled=0;
+      wd[chan].outages++;
+      wd[chan].deadtime+=dt;
+      printdate(); printf("Channel %c resumed after %.1f ms outage (%llu outages, %.1f ms total)\n", chan ? 'B' : 'A',
+                          dt/1e6, (long long unsigned)wd[chan].outages, wd[chan].deadtime/1e6);
+    }
+}
+
+void printdate();
+
+void checkstall(int chan, volatile unsigned char *txstat, uint64_t t) // detects stalled channel and requests recovery
+{
+    watchdog_t *c=&wd[chan];
+    uint64_t since=0;
+    char cmd[16];
+    int force=0;
+    if(*txstat<0x80) { if(c->txbusy==0) c->txbusy=t; }
+    else c->txbusy=0;
+    if(c->stalled || t-c->lastrec<STALL_HOLDOFF*1000000000ULL) return;
+    if(c->txbusy && t-c->txbusy>UART_TIMEOUT*1000ULL) since=c->txbusy;
+    else if(stallrate>0 && c->rate>stallrate && t-c->last>STALL_SEC*1000000000ULL) { since=c->last; force=RECOVER_FORCE; } // TX is fine, reset only on request
+    if(since==0) return;
+    printdate(); printf("Channel %c stalled (%s), requesting recovery\n", chan ? 'B' : 'A', c->txbusy ? "TX not ready" : "no data");
+    c->stalled=since;
+    c->lastrec=t;
+    c->rate=0; // a channel that stays quiet after recovery is not stalled again
+    snprintf(cmd,sizeof(cmd),"RECOVER %d",chan|force);
+    zmq_send (cmdsock, "", 0, ZMQ_SNDMORE|ZMQ_DONTWAIT);
+    zmq_send (cmdsock, cmd, strlen(cmd), ZMQ_DONTWAIT);
+    trigger("stall");
+}
+
 void printdate()
 {
     char str[64];
@@ -72,6 +211,16 @@ int main (int argc, char **argv)
 {
 
 int rv;
+size_t recmb=REC_MB;
+if(argc>1) recmb=strtoul(argv[1],NULL,0);
+if(argc>2) recsec=strtoul(argv[2],NULL,0);
+if(argc>3) stallrate=strtod(argv[3],NULL);
+reclen=recmb*1024*1024/sizeof(rec_word_t);
+if(reclen<1) reclen=1;
+rec=calloc(reclen,sizeof(rec_word_t));
+if(rec==NULL) {printdate(); printf("Can't allocate %zu MB for flight recorder! Exiting.\n",recmb); return 0;}
+signal(SIGUSR1, onsignal);
+signal(SIGCHLD, SIG_IGN); // don't leave zombie dump processes
 context = zmq_ctx_new();
 
 //  Socket to send data to clients
@@ -79,6 +228,17 @@ publisher = zmq_socket (context, ZMQ_PUB);
 rv = zmq_bind (publisher, "tcp://*:5556");
 if(rv<0) {printdate(); printf("Can't bind tcp socket for data! ERRNO=%d. Exiting.\n",errno); return 0;}
 printdate(); printf ("pixlar_server: data publisher at tcp://5556\n");
+control = zmq_socket (context, ZMQ_PULL);
+rv = zmq_bind (control, "tcp://*:5557");
+if(rv<0) {printdate(); printf("Can't bind tcp socket for control! ERRNO=%d. Exiting.\n",errno); return 0;}
+printdate(); printf ("pixlar_server: flight recorder %zu MB, %d s window, control at tcp://5557, SIGUSR1 to dump\n",recmb,(int)recsec);
+if(stallrate>0) { printdate(); printf ("pixlar_server: channels silent for %d s after %.1f words/s are reset\n",STALL_SEC,stallrate); }
+else { printdate(); printf ("pixlar_server: only TX stalls are recovered, no-data rule is off (3rd argument: rate threshold, words/s)\n"); }
+ack = zmq_socket (context, ZMQ_PUSH);
+rv = zmq_bind (ack, "tcp://*:5558");
+if(rv<0) {printdate(); printf("Can't bind tcp socket for acknowledgements! ERRNO=%d. Exiting.\n",errno); return 0;}
+cmdsock = zmq_socket (context, ZMQ_DEALER);
+zmq_connect (cmdsock, CMD_SOCK);
 
 
     off_t offsetA = UART54_A_RECV;
@@ -94,12 +254,13 @@ printdate(); printf ("pixlar_server: data publisher at tcp://5556\n");
 
     int fd = open("/dev/mem", O_RDWR | O_SYNC);
 //    volatile unsigned char *mem = mmap(NULL, page_offset + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_base);
-    volatile unsigned char *memA = mmap(NULL, page_offsetA + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_baseA);
+    // map SEND register too, its TX ready bit shows stalled channel
+    volatile unsigned char *memA = mmap(NULL, page_offsetA + len + 8, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_baseA);
     if (memA == MAP_FAILED) {
         perror("Can't map A memory");
         return -1;
     }
-    volatile unsigned char *memB = mmap(NULL, page_offsetB + len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_baseB);
+    volatile unsigned char *memB = mmap(NULL, page_offsetB + len + 8, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_baseB);
     if (memB == MAP_FAILED) {
         perror("Can't map B memory");
         return -1;
@@ -107,14 +268,106 @@ printdate(); printf ("pixlar_server: data publisher at tcp://5556\n");
 
 
 
+uint64_t w, t, tsec=now_ns(), nsec=0, nwords=0;
+int i;
+double avgrate=0;
+uint64_t lastauto=0;
+unsigned int loops=0;
+int resume=0;
+char ctl[32];
+wd[0].last=wd[1].last=tsec;
+
 while(1) //main loop
 {
 
+    if(++loops==POLL_EVERY)
+    {
+    loops=0;
+    rv= nmark ? -1 : zmq_recv (control, ctl, sizeof(ctl)-1, ZMQ_DONTWAIT); // next control message after pending marker is out
+    if(rv>=0)
+      {
+      ctl[rv<(int)sizeof(ctl)-1 ? rv : (int)sizeof(ctl)-1]=0;
+      if(strncmp(ctl,"RECDUMP",7)==0) trigger("cmd");
+      else if(strncmp(ctl,"PAUSE",5)==0) // UARTs are not read after acknowledgement
+        {
+        char reply[40];
+        unsigned int n=0;
+        unsigned long long maxms=PAUSE_MAX;
+        sscanf(ctl+5,"%u %llu",&n,&maxms);
+        paused=1;
+        pauseend=now_ns()+maxms*1000000ULL;
+        snprintf(reply,sizeof(reply),"PAUSED %u",n); // same sequence number
+        zmq_send (ack, reply, strlen(reply), ZMQ_DONTWAIT);
+        }
+      else if(strcmp(ctl,"RESUME")==0) resume=1;
+      else if(strncmp(ctl,"DAQ_BEG ",8)==0) // "DAQ_BEG <run> [<previous run>]", previous run ends right before
+        {
+        unsigned int run=0, prev;
+        if(sscanf(ctl+8,"%u %u",&run,&prev)==2) mark[nmark++]=MARK_WORD(MARK_END, prev);
+        mark[nmark++]=MARK_WORD(MARK_BEG, run);
+        }
+      else if(strncmp(ctl,"DAQ_END ",8)==0) mark[nmark++]=MARK_WORD(MARK_END, strtoul(ctl+8,NULL,0));
+      }
+    rv=zmq_recv (cmdsock, ctl, sizeof(ctl)-1, ZMQ_DONTWAIT); // recovery reply: delimiter, then status
+    if(rv>0) { ctl[rv<(int)sizeof(ctl)-1 ? rv : (int)sizeof(ctl)-1]=0; printdate(); printf("Recovery reply: %s\n",ctl); }
+    if(exttrig) { exttrig=0; trigger("ext"); }
+    t=now_ns();
+    if(paused && t>=pauseend) // pixlar_cmdserver died or hung during pause
+      {
+      printdate(); printf("No RESUME from pixlar_cmdserver, resuming readout after pause limit\n");
+      resume=1;
+      }
+    if(resume && paused) // rates restart, pause is not an anomaly
+      {
+      paused=0;
+      tsec=wd[0].last=wd[1].last=t; nsec=0; avgrate=0;
+      wd[0].n=wd[1].n=0;
+      }
+    resume=0;
+    if(!paused && t-tsec>=1000000000ULL) // rate anomaly check once per second, words are not read while paused
+      {
+      double rate=nsec*1e9/(t-tsec);
+      if(avgrate>REC_RATEMIN && (rate>avgrate*REC_RATEFAC || rate*REC_RATEFAC<avgrate) && t-lastauto>REC_HOLDOFF*1000000000ULL)
+        { lastauto=t; trigger("rate"); }
+      avgrate= avgrate==0 ? rate : 0.9*avgrate+0.1*rate;
+      for(i=0; i<2; i++)
+        {
+        rate=wd[i].n*1e9/(t-tsec);
+        wd[i].rate= wd[i].rate==0 ? rate : 0.9*wd[i].rate+0.1*rate;
+        wd[i].n=0;
+        }
+      tsec=t; nsec=0;
+      }
+    if(!paused)
+      {
+      checkstall(0, memA+page_offsetA+len+7, t);
+      checkstall(1, memB+page_offsetB+len+7, t);
+      }
+    if(trigtime && t-trigtime>=REC_POST*1000000000ULL) recdump();
+    }
+
+    if(nmark) // markers go out even when paused, words read before them belong to the previous run
+    {
+    if(bufbusy) continue;
+    uint64_t m=mark[imark++];
+    printdate(); printf("Run %u %s at word %llu\n", MARK_RUN(m), MARK_TYPE(m)==MARK_BEG ? "begins" : "ends", (long long unsigned)nwords);
+    memcpy(evbuf,&m,8);
+    record(m);
+    bufbusy=1;
+    sendout(evbuf);
+    if(imark==nmark) nmark=imark=0;
+    continue; // no UART read until all markers are out, END and BEG of back-to-back runs are adjacent
+    }
+
+    if(paused) continue;
+
     if(memA[page_offsetA+len-1]>=0x80 && bufbusy==0)
     {
     printf("A:");
     dump(memA+page_offsetA);
-    memcpy(evbuf,(void*)(memA+page_offsetA),8);
+    memcpy(&w,(void*)(memA+page_offsetA),8);
+    memcpy(evbuf,&w,8);
+    gotword(0, record(w)); nsec++; nwords++;
     bufbusy=1;
     sendout(evbuf);
     memA[page_offsetA+len-1]=0;
@@ -123,7 +376,10 @@ while(1) //main loop
     {
     printf("B:");
     dump(memB+page_offsetB);
-    memcpy(evbuf,(void*)(memB+page_offsetB),8);
+    memcpy(&w,(void*)(memB+page_offsetB),8);
+    w|=WORD_CHANB;
+    memcpy(evbuf,&w,8);
+    gotword(1, record(w)); nsec++; nwords++;
     bufbusy=1;
     sendout(evbuf);
     memB[page_offsetB+len-1]=0;